@@ -0,0 +1,180 @@
+// Microbenchmarks of the kernels behind the counting/min DP: CBigInt arithmetic and NativeSolver on single polygons.
+// Built by "make microbench" without the thread sanitizer, run "./microbench [filter]" to run the matching benchmarks.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "progtest_solver.h"
+#include "sample_tester.h"
+
+using namespace std;
+
+// compile the solution the way progtest does: headers first, local test code excluded
+#define __PROGTEST__
+#include "solution.cpp"
+
+//=============================================================================================================================================================
+template<typename T>
+static void doNotOptimize(T &x) {
+    __asm__ __volatile__("" : : "r"(&x) : "memory");
+}
+
+static uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Runs a benchmark body in samples of a calibrated number of iterations (each sample takes at least MIN_SAMPLE)
+ * and reports the median ns/op and cycles/op, the fastest sample and the median absolute deviation.
+ * Cycles are TSC reference cycles, they are not available on non-x86 targets.
+ */
+class CMicroBench {
+public:
+    static constexpr int SAMPLES = 21;
+    static constexpr std::chrono::microseconds MIN_SAMPLE{2000};
+
+    explicit CMicroBench(const char *filter) : m_Filter(filter) {
+        printf("%-32s %12s %12s %12s %8s %10s\n", "benchmark", "ns/op", "cycles/op", "min ns/op", "mad %", "iters");
+    }
+
+    void run(const std::string &name, const std::function<void()> &body) {
+        if (m_Filter && name.find(m_Filter) == std::string::npos)
+            return;
+
+        size_t iters = 1;
+        while (measure(body, iters).first < MIN_SAMPLE.count() * 1000.0)
+            iters *= 2;
+
+        std::vector<double> ns, cycles;
+        for (int i = 0; i < SAMPLES; i++) {
+            auto [sampleNs, sampleCycles] = measure(body, iters);
+            ns.push_back(sampleNs / iters);
+            cycles.push_back(sampleCycles / iters);
+        }
+
+        double medianNs = median(ns);
+        std::vector<double> dev;
+        for (double x : ns)
+            dev.push_back(std::fabs(x - medianNs));
+
+        printf("%-32s %12.1f %12.1f %12.1f %8.2f %10zu\n", name.c_str(), medianNs, median(cycles),
+               *std::min_element(ns.begin(), ns.end()), 100 * median(dev) / medianNs, iters);
+    }
+
+private:
+    const char *m_Filter;
+
+    static std::pair<double, double> measure(const std::function<void()> &body, size_t iters) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startCycles = readCycles();
+        for (size_t i = 0; i < iters; i++)
+            body();
+        uint64_t cycles = readCycles() - startCycles;
+        return {std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count(), (double)cycles};
+    }
+
+    static double median(std::vector<double> x) {
+        std::nth_element(x.begin(), x.begin() + x.size() / 2, x.end());
+        return x[x.size() / 2];
+    }
+};
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+static CBigInt randomBigInt(uint32_t bits) {
+    CBigInt res, shift(uint64_t(1) << 32);
+    for (uint32_t i = 0; i < bits; i += 32) {
+        res *= shift;
+        res += CBigInt((uint32_t)rand() | 1u << 31);
+    }
+    return res;
+}
+
+static CPolygon convexPolygon(size_t n) {
+    CPolygon res;
+    for (size_t i = 0; i < n; i++)
+        res.add(CPoint((int)std::lround(100000 * std::cos(2 * M_PI * i / n)), (int)std::lround(100000 * std::sin(2 * M_PI * i / n))));
+    return res;
+}
+
+// star shaped polygon, every other vertex is pulled towards the center
+static CPolygon spikyPolygon(size_t n) {
+    CPolygon res;
+    for (size_t i = 0; i < n; i++) {
+        double r = i % 2 ? 30000 : 100000;
+        res.add(CPoint((int)std::lround(r * std::cos(2 * M_PI * i / n)), (int)std::lround(r * std::sin(2 * M_PI * i / n))));
+    }
+    return res;
+}
+
+static void benchPolygon(CMicroBench &bench, const std::string &name, const CPolygon &polygon) {
+    bench.run("min/" + name, [&]() {
+        double res = NativeSolver(polygon).minTriangulation();
+        doNotOptimize(res);
+    });
+    bench.run("cnt/" + name, [&]() {
+        CBigInt res = NativeSolver(polygon).cntTriangulations();
+        doNotOptimize(res);
+    });
+}
+
+int main(int argc, char *argv[]) {
+    CMicroBench bench(argc > 1 ? argv[1] : nullptr);
+    srand(12345);
+
+    for (uint32_t bits : {32, 128, 256, 512, 1024}) {
+        CBigInt a = randomBigInt(bits), b = randomBigInt(bits), acc = a;
+        std::string suffix = "/" + std::to_string(bits) + "b";
+
+        bench.run("bigint.mul" + suffix, [&]() {
+            CBigInt res = a;
+            res *= b;
+            doNotOptimize(res);
+        });
+        bench.run("bigint.add" + suffix, [&]() {
+            acc += b;
+            doNotOptimize(acc);
+        });
+        bench.run("bigint.toString" + suffix, [&]() {
+            std::string res = a.toString();
+            doNotOptimize(res);
+        });
+    }
+
+    for (size_t n : {8, 16, 32, 64, 128}) {
+        benchPolygon(bench, "convex/" + std::to_string(n), convexPolygon(n));
+        benchPolygon(bench, "spiky/" + std::to_string(n), spikyPolygon(n));
+    }
+
+    size_t idx = 0;
+    for (const auto &data : g_Data)
+        benchPolygon(bench, "gdata" + std::to_string(idx++) + "/" + std::to_string(data.m_Polygon->m_Points.size()),
+                     *data.m_Polygon);
+    return 0;
+}
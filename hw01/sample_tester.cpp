@@ -9,13 +9,6 @@
 
 #include <iostream>
 
-class CTestData {
-public:
-    APolygon m_Polygon;
-    double m_TriangMin;
-    const char *m_TriangCnt;
-};
-
 //=============================================================================================================================================================
 std::initializer_list<CTestData> g_Data =
         {
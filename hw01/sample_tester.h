@@ -5,6 +5,20 @@
 #define SAMPLE_TESTER_H_2983745628345129345
 
 #include "common.h"
+#include <initializer_list>
+
+//=============================================================================================================================================================
+/**
+ * A test problem with the reference results, the test problems are in g_Data.
+ */
+class CTestData {
+public:
+    APolygon m_Polygon;
+    double m_TriangMin;
+    const char *m_TriangCnt;
+};
+
+extern std::initializer_list<CTestData> g_Data;
 
 //=============================================================================================================================================================
 /**
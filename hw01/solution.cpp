@@ -42,18 +42,58 @@
 using namespace std;
 #endif /* __PROGTEST__ */
 
+// not part of the progtest header set
+#include <fstream>
+#include <random>
+#include <sched.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define REMOTE_WORKERS_SUPPORTED
+#endif
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 struct ProblemPackWrapper;
+struct CompanyWrapper;
+
+/**
+ * A pooled sender thread serving several companies. Companies whose head pack became solved are queued in ready,
+ * so the thread only touches companies that have something to deliver.
+ */
+struct SenderSlot {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<CompanyWrapper *> ready;
+    std::vector<CompanyWrapper *> companies;
+};
 
 struct CompanyWrapper {
     ACompany company;
+    uint32_t id;
+    uint32_t packSeq = 0;
     shared_ptr<std::condition_variable> cv;
     std::queue<shared_ptr<ProblemPackWrapper>> problemPacks;
     shared_ptr<std::mutex> mtx;
+    SenderSlot *sender = nullptr;                // nullptr = dedicated sender thread
+    bool readyQueued = false;                    // guarded by sender->mtx
 
-    explicit CompanyWrapper(ACompany company)
-        : company(std::move(company)), cv(std::make_shared<std::condition_variable>()), mtx(std::make_shared<std::mutex>()) {
+    CompanyWrapper(ACompany company, uint32_t id)
+        : company(std::move(company)), id(id), cv(std::make_shared<std::condition_variable>()), mtx(std::make_shared<std::mutex>()) {
+    }
+
+    void notifySolved() {
+        if (!sender) {
+            cv->notify_all();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(sender->mtx);
+        if (!readyQueued) {
+            readyQueued = true;
+            sender->ready.push_back(this);
+            sender->cv.notify_one();
+        }
     }
 };
 
@@ -61,6 +101,7 @@ struct ProblemPackWrapper {
     CompanyWrapper *companyWrapper;
     AProblemPack problemPack;
     atomic<size_t> solved = 0;
+    uint32_t seq = 0;
 
     bool isSolved() const {
         return problemPack->m_ProblemsMin.size() + problemPack->m_ProblemsCnt.size() == solved;
@@ -71,58 +112,791 @@ struct ProblemPackWrapper {
     }
 };
 
+/**
+ * In-process triangulation engine. Both problems are solved by the O(n^3) interval DP over the polygon vertices:
+ * the sub-polygon i..j is split by a triangle (i, k, j) whose sides must be polygon edges or internal diagonals.
+ * The cost of the minimal triangulation is the perimeter plus the lengths of the used diagonals.
+ */
+class NativeSolver {
+public:
+    explicit NativeSolver(const CPolygon &polygon) : pts(polygon.m_Points), n(pts.size()) {
+        int64_t area = 0;
+        for (size_t i = 0; i < n; i++)
+            area += cross(pts[i], pts[(i + 1) % n]);
+        if (area < 0)
+            std::reverse(pts.begin(), pts.end());
+
+        valid.assign(n * n, 0);
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = i + 1; j < n; j++)
+                valid[i * n + j] = valid[j * n + i] = j == i + 1 || (i == 0 && j == n - 1) || isDiagonal(i, j);
+    }
+
+    double minTriangulation() const {
+        if (n < 3)
+            return 0;
+
+        std::vector<double> cost(n * n, 0);
+        for (size_t len = 2; len < n; len++)
+            for (size_t i = 0; i + len < n; i++) {
+                size_t j = i + len;
+                double best = INFINITY;
+                for (size_t k = i + 1; k < j; k++)
+                    if (valid[i * n + k] && valid[k * n + j])
+                        best = std::min(best, cost[i * n + k] + cost[k * n + j]);
+                cost[i * n + j] = best + (len == n - 1 ? 0 : dist(i, j));
+            }
+
+        double perimeter = 0;
+        for (size_t i = 0; i < n; i++)
+            perimeter += dist(i, (i + 1) % n);
+        return cost[n - 1] + perimeter;
+    }
+
+    CBigInt cntTriangulations() const {
+        if (n < 3)
+            return 0;
+
+        std::vector<CBigInt> cnt(n * n);
+        for (size_t i = 0; i + 1 < n; i++)
+            cnt[i * n + i + 1] = 1;
+        for (size_t len = 2; len < n; len++)
+            for (size_t i = 0; i + len < n; i++) {
+                size_t j = i + len;
+                if (!valid[i * n + j])
+                    continue;
+                CBigInt &res = cnt[i * n + j];
+                for (size_t k = i + 1; k < j; k++)
+                    if (valid[i * n + k] && valid[k * n + j] && !cnt[i * n + k].isZero() && !cnt[k * n + j].isZero())
+                        res += cnt[i * n + k] * cnt[k * n + j];
+            }
+        return cnt[n - 1];
+    }
+
+private:
+    std::vector<CPoint> pts;
+    size_t n;
+    std::vector<char> valid;
+
+    static int64_t cross(const CPoint &a, const CPoint &b) {
+        return (int64_t)a.m_X * b.m_Y - (int64_t)a.m_Y * b.m_X;
+    }
+    static int64_t orient(const CPoint &a, const CPoint &b, const CPoint &c) {
+        return (int64_t)(b.m_X - a.m_X) * (c.m_Y - a.m_Y) - (int64_t)(b.m_Y - a.m_Y) * (c.m_X - a.m_X);
+    }
+    static bool between(const CPoint &a, const CPoint &b, const CPoint &c) {
+        return std::min(a.m_X, b.m_X) <= c.m_X && c.m_X <= std::max(a.m_X, b.m_X)
+               && std::min(a.m_Y, b.m_Y) <= c.m_Y && c.m_Y <= std::max(a.m_Y, b.m_Y);
+    }
+    static bool intersect(const CPoint &a, const CPoint &b, const CPoint &c, const CPoint &d) {
+        int64_t o1 = orient(a, b, c), o2 = orient(a, b, d), o3 = orient(c, d, a), o4 = orient(c, d, b);
+        if (((o1 > 0 && o2 < 0) || (o1 < 0 && o2 > 0)) && ((o3 > 0 && o4 < 0) || (o3 < 0 && o4 > 0)))
+            return true;
+        return (!o1 && between(a, b, c)) || (!o2 && between(a, b, d))
+               || (!o3 && between(c, d, a)) || (!o4 && between(c, d, b));
+    }
+    double dist(size_t i, size_t j) const {
+        return std::hypot((double)pts[i].m_X - pts[j].m_X, (double)pts[i].m_Y - pts[j].m_Y);
+    }
+    // segment i-j leaves vertex i towards the polygon interior (counter-clockwise orientation)
+    bool inCone(size_t i, size_t j) const {
+        const CPoint &prev = pts[(i + n - 1) % n], &cur = pts[i], &next = pts[(i + 1) % n];
+        if (orient(prev, cur, next) >= 0)
+            return orient(cur, pts[j], prev) > 0 && orient(pts[j], cur, next) > 0;
+        return !(orient(cur, pts[j], next) >= 0 && orient(pts[j], cur, prev) >= 0);
+    }
+    bool isDiagonal(size_t i, size_t j) const {
+        if (!inCone(i, j) || !inCone(j, i))
+            return false;
+        for (size_t k = 0; k < n; k++) {
+            size_t l = (k + 1) % n;
+            if (k != i && k != j && l != i && l != j && intersect(pts[i], pts[j], pts[k], pts[l]))
+                return false;
+        }
+        return true;
+    }
+};
+
+struct LedgerStats {
+    size_t instances = 0;                        // progtest solvers requested from the factory
+    size_t unusable = 0;                         // null or zero capacity instances
+    size_t rejected = 0;                         // addPolygon refused although capacity was reported
+    size_t wrongResults = 0;                     // batches that failed the native spot check
+    size_t filled = 0;                           // instances used up to their capacity ...
+    size_t capacity = 0;                         // ... and their total capacity
+    size_t used = 0;                             // polygons solved by progtest solvers
+    size_t native = 0;                           // polygons solved by NativeSolver
+    size_t remote = 0;                           // polygons solved by remote worker processes
+    size_t prefetchHits = 0;                     // rollovers served from the ready pool
+    size_t prefetchMisses = 0;                   // rollovers that waited under queueMtx for the prefetcher
+    bool exhausted = false;
+};
+
+/**
+ * Capacity ledger of one problem kind. Once an unusable progtest solver shows up (null, zero capacity, refusing
+ * polygons or failing the spot check), the kind is marked exhausted and the remaining polygons go to NativeSolver.
+ */
+struct SolverLedger {
+    std::atomic<size_t> instances = 0, unusable = 0, rejected = 0, wrongResults = 0, filled = 0, capacity = 0,
+                        used = 0, native = 0, remote = 0, prefetchHits = 0, prefetchMisses = 0;
+    std::atomic<bool> exhausted = false;
+
+    LedgerStats stats() const {
+        return {instances, unusable, rejected, wrongResults, filled, capacity, used, native, remote, prefetchHits,
+                prefetchMisses, exhausted};
+    }
+};
+
+/**
+ * Worker processes solving native batches out of the optimizer's address space. Each process is forked in start()
+ * (before the optimizer creates any thread) and talks over its own Unix domain socket pair. All integers are
+ * host-endian, every message is prefixed by its uint32 byte length:
+ *  - request:  uint32 kind (0 = min, 1 = cnt), uint32 polygons, per polygon uint32 points and int32 x, y pairs,
+ *  - response: per polygon a double (min) or uint16 length + decimal digits of CBigInt (cnt).
+ * A transport error disables the channel and the caller solves the batch locally.
+ */
+class RemoteWorkers {
+public:
+    ~RemoteWorkers() {
+        stop();
+    }
+
+    bool start(int processes) {
+#ifdef REMOTE_WORKERS_SUPPORTED
+        for (int i = 0; i < processes; i++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+                break;
+
+            // the child must not write out the parent's buffered output again
+            fflush(nullptr);
+            pid_t pid = fork();
+            if (pid < 0) {
+                ::close(fds[0]);
+                ::close(fds[1]);
+                break;
+            }
+            if (!pid) {
+                for (const auto &channel : channels)
+                    ::close(channel->fd);
+                ::close(fds[0]);
+                serve(fds[1]);
+                _exit(0);
+            }
+            ::close(fds[1]);
+            channels.emplace_back(std::make_unique<Channel>(fds[0], pid));
+        }
+#endif
+        return !channels.empty();
+    }
+
+    void stop() {
+#ifdef REMOTE_WORKERS_SUPPORTED
+        for (auto &channel : channels) {
+            if (channel->fd >= 0)
+                ::close(channel->fd);
+            waitpid(channel->pid, nullptr, 0);
+        }
+#endif
+        channels.clear();
+    }
+
+    bool enabled() const {
+        return !channels.empty();
+    }
+
+    /**
+     * Solve the polygons in one of the worker processes and store the results into them.
+     * @return false if the batch could not be solved remotely
+     */
+    bool solve(const std::string &type, const std::vector<APolygon> &polygons) {
+#ifdef REMOTE_WORKERS_SUPPORTED
+        std::string request;
+        put<uint32_t>(request, type == "cnt");
+        put<uint32_t>(request, polygons.size());
+        for (const auto &polygon : polygons) {
+            put<uint32_t>(request, polygon->m_Points.size());
+            for (const auto &point : polygon->m_Points) {
+                put<int32_t>(request, point.m_X);
+                put<int32_t>(request, point.m_Y);
+            }
+        }
+
+        // prefer an idle process, otherwise queue on the next one
+        size_t start = next++;
+        for (size_t i = 0; i <= channels.size(); i++) {
+            Channel &channel = *channels[(start + i) % channels.size()];
+            std::unique_lock<std::mutex> lock(channel.mtx, std::defer_lock);
+            if (i < channels.size() ? !lock.try_lock() : (lock.lock(), false))
+                continue;
+            if (channel.fd < 0)
+                continue;
+
+            std::string response;
+            if (sendMessage(channel.fd, request) && recvMessage(channel.fd, response)
+                && decodeResults(type, response, polygons))
+                return true;
+
+            ::close(channel.fd);
+            channel.fd = -1;
+        }
+#endif
+        return false;
+    }
+
+private:
+    struct Channel {
+        int fd;
+        pid_t pid;
+        std::mutex mtx;
+
+        Channel(int fd, pid_t pid) : fd(fd), pid(pid) {
+        }
+    };
+
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::atomic<size_t> next = 0;
+
+    template<typename T>
+    static void put(std::string &buffer, T value) {
+        buffer.append((const char *)&value, sizeof(value));
+    }
+
+    template<typename T>
+    static bool get(const std::string &buffer, size_t &pos, T &value) {
+        if (pos + sizeof(value) > buffer.size())
+            return false;
+        std::memcpy(&value, buffer.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+#ifdef REMOTE_WORKERS_SUPPORTED
+    static bool writeAll(int fd, const char *data, size_t len) {
+        while (len) {
+            ssize_t written = send(fd, data, len, MSG_NOSIGNAL);
+            if (written <= 0)
+                return false;
+            data += written;
+            len -= written;
+        }
+        return true;
+    }
+
+    static bool readAll(int fd, char *data, size_t len) {
+        while (len) {
+            ssize_t got = recv(fd, data, len, 0);
+            if (got <= 0)
+                return false;
+            data += got;
+            len -= got;
+        }
+        return true;
+    }
+
+    static bool sendMessage(int fd, const std::string &message) {
+        uint32_t len = message.size();
+        return writeAll(fd, (const char *)&len, sizeof(len)) && writeAll(fd, message.data(), message.size());
+    }
+
+    static bool recvMessage(int fd, std::string &message) {
+        uint32_t len;
+        if (!readAll(fd, (char *)&len, sizeof(len)))
+            return false;
+        message.resize(len);
+        return readAll(fd, message.data(), len);
+    }
+
+    static bool decodeResults(const std::string &type, const std::string &response, const std::vector<APolygon> &polygons) {
+        size_t pos = 0;
+        for (const auto &polygon : polygons) {
+            if (type == "min") {
+                if (!get(response, pos, polygon->m_TriangMin))
+                    return false;
+                continue;
+            }
+            uint16_t len;
+            if (!get(response, pos, len) || pos + len > response.size())
+                return false;
+            polygon->m_TriangCnt = CBigInt(std::string_view(response.data() + pos, len));
+            pos += len;
+        }
+        return pos == response.size();
+    }
+
+    // worker process main loop, returns when the optimizer closes the socket
+    static void serve(int fd) {
+        std::string request, response;
+        while (recvMessage(fd, request)) {
+            size_t pos = 0;
+            uint32_t kind, count;
+            response.clear();
+            if (!get(request, pos, kind) || !get(request, pos, count))
+                return;
+
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t points;
+                CPolygon polygon;
+                if (!get(request, pos, points))
+                    return;
+                for (uint32_t j = 0; j < points; j++) {
+                    int32_t x, y;
+                    if (!get(request, pos, x) || !get(request, pos, y))
+                        return;
+                    polygon.add(CPoint(x, y));
+                }
+
+                NativeSolver solver(polygon);
+                if (!kind)
+                    put(response, solver.minTriangulation());
+                else {
+                    std::string cnt = solver.cntTriangulations().toString();
+                    put<uint16_t>(response, cnt.size());
+                    response += cnt;
+                }
+            }
+            if (!sendMessage(fd, response))
+                return;
+        }
+    }
+#endif
+};
+
 struct SolverWrapper {
+    static constexpr size_t NATIVE_BATCH = 16;
+    static constexpr size_t SPOT_CHECK_VERTICES = 64;    // O(n^3), about what the solver spends on one polygon
+
     std::string type;
-    AProgtestSolver solver;
+    AProgtestSolver solver;                      // nullptr = batch for NativeSolver
+    SolverLedger *ledger;
+    RemoteWorkers *remote = nullptr;             // native batches are shipped to worker processes if enabled
+    std::vector<APolygon> polygons;
     std::unordered_map<shared_ptr<ProblemPackWrapper>, size_t> inSolver;
 
-    SolverWrapper(std::string type, AProgtestSolver solver) : type(std::move(type)), solver(std::move(solver)){
+    SolverWrapper(std::string type, AProgtestSolver solver, SolverLedger *ledger)
+        : type(std::move(type)), solver(std::move(solver)), ledger(ledger) {
+    }
+
+    bool isNative() const {
+        return !solver;
+    }
+
+    bool add(const APolygon &polygon) {
+        if (solver && !solver->addPolygon(polygon))
+            return false;
+        polygons.push_back(polygon);
+        return true;
+    }
+
+    bool isFull() const {
+        return solver ? !solver->hasFreeCapacity() : polygons.size() >= NATIVE_BATCH;
+    }
+
+    void solveNative(const APolygon &polygon) const {
+        type == "min" ? polygon->m_TriangMin = NativeSolver(*polygon).minTriangulation() :
+                        polygon->m_TriangCnt = NativeSolver(*polygon).cntTriangulations();
+    }
+
+    /**
+     * Check one polygon of every batch against the progtest result: a random one, or the smallest one if the random
+     * one is too expensive to recompute. A polygon over SPOT_CHECK_VERTICES (the whole batch is that large) only has
+     * its result checked against the bounds every triangulation satisfies.
+     */
+    bool spotCheck() const {
+        if (polygons.empty())
+            return true;
+        thread_local std::mt19937 random(std::random_device{}());
+        const CPolygon *polygon = polygons[random() % polygons.size()].get();
+        if (polygon->m_Points.size() > SPOT_CHECK_VERTICES)
+            polygon = std::min_element(polygons.begin(), polygons.end(), [](const APolygon &a, const APolygon &b) {
+                return a->m_Points.size() < b->m_Points.size();
+            })->get();
+        if (polygon->m_Points.size() > SPOT_CHECK_VERTICES)
+            return inBounds(*polygon);
+
+        NativeSolver native(*polygon);
+        if (type == "cnt")
+            return native.cntTriangulations() == polygon->m_TriangCnt;
+
+        double ref = native.minTriangulation();
+        return std::fabs(polygon->m_TriangMin - ref) <= 1e8 * DBL_EPSILON * std::fabs(ref);
+    }
+
+    // the perimeter <= min <= the perimeter plus n - 3 diagonals, none longer than half of it; 1 <= cnt < 4^(n - 2)
+    bool inBounds(const CPolygon &polygon) const {
+        size_t n = polygon.m_Points.size();
+        if (type == "cnt") {
+            CBigInt bound = 1;
+            for (size_t i = 2; i < n; i++)
+                bound *= 4;
+            return !polygon.m_TriangCnt.isZero() && polygon.m_TriangCnt < bound;
+        }
+
+        double perimeter = 0;
+        for (size_t i = 0; i < n; i++) {
+            const CPoint &a = polygon.m_Points[i], &b = polygon.m_Points[(i + 1) % n];
+            perimeter += std::hypot((double)a.m_X - b.m_X, (double)a.m_Y - b.m_Y);
+        }
+        double slack = 1e8 * DBL_EPSILON * perimeter;
+        return polygon.m_TriangMin >= perimeter - slack && polygon.m_TriangMin <= perimeter * (n - 1) / 2 + slack;
+    }
+
+    bool solveProgtest() const {
+        if (solver->solve() == polygons.size() && spotCheck()) {
+            ledger->used += polygons.size();
+            return true;
+        }
+        ledger->wrongResults++;
+        ledger->exhausted = true;
+        return false;
     }
 
     void solveWrapper() const {
-        solver->solve();
+        if (isNative() && remote && remote->enabled() && remote->solve(type, polygons))
+            ledger->remote += polygons.size();
+        else if (isNative() || !solveProgtest()) {
+            for (const auto &polygon : polygons)
+                solveNative(polygon);
+            ledger->native += polygons.size();
+        }
 
         for (const auto& [x, problems] : inSolver) {
             x->solved += problems;
 
             if (x->isSolved())
-                x->companyWrapper->cv->notify_all();
+                x->companyWrapper->notifySolved();
         }
     }
 };
 
+/**
+ * Thread placement policy of COptimizer. None leaves everything to the OS scheduler, Spread pins each worker to its
+ * own physical core and keeps the (mostly idle) receiver/sender threads on the cores (or SMT siblings) not used
+ * by the workers. Workers pin themselves before they allocate anything, so the memory they first-touch (malloc
+ * arena, solver DP tables) ends up on the NUMA node of their core.
+ */
+enum class PlacementPolicy {
+    None,
+    Spread
+};
+
+struct PlacementStats {
+    PlacementPolicy policy = PlacementPolicy::None;
+    size_t physicalCores = 0;
+    std::vector<int> workerCpus;                 // CPU of every started worker, -1 = not pinned
+    std::vector<int> commCpus;                   // empty = not pinned
+    std::atomic<size_t> pinFailures = 0;
+
+    PlacementStats() = default;
+    PlacementStats(const PlacementStats &x)
+        : policy(x.policy), physicalCores(x.physicalCores), workerCpus(x.workerCpus), commCpus(x.commCpus),
+          pinFailures(x.pinFailures.load()) {
+    }
+};
+
+/**
+ * Logical CPUs available to the process grouped by physical core (SMT siblings share a group).
+ * Falls back to one CPU per core if the topology cannot be read.
+ */
+static std::vector<std::vector<int>> detectPhysicalCores() {
+    std::vector<std::vector<int>> cores;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return cores;
+
+    std::map<std::pair<int, int>, size_t> coreIdx;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        int package = -1, core = cpu;
+        std::ifstream(dir + "physical_package_id") >> package;
+        std::ifstream(dir + "core_id") >> core;
+
+        auto [it, inserted] = coreIdx.emplace(std::make_pair(package, core), cores.size());
+        if (inserted)
+            cores.emplace_back();
+        cores[it->second].push_back(cpu);
+    }
+#endif
+    return cores;
+}
+
+static bool pinCurrentThread(const std::vector<int> &cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return false;
+#endif
+}
+
+/**
+ * Opt-in binary trace of an optimizer run, replayed by CCompanyReplay in the local tests. The file starts with
+ * TRACE_MAGIC and TRACE_VERSION, followed by records of a fixed header (event, kind, arg, time in ns since start())
+ * and an event specific payload:
+ *  - Pack:          arg = company, payload seq, nMin, nCnt and the vertex count of every polygon (all uint32)
+ *  - SolverCreated: arg = 1 if the instance is usable
+ *  - SolverFilled:  arg = capacity of the instance
+ *  - Solve:         arg = polygons in the batch, flags = 1 for a native batch, payload duration (uint64 ns)
+ *  - Deliver:       arg = company, payload seq (uint32) and the time spent in solvedPack (uint64 ns)
+ */
+class TraceRecorder {
+public:
+    static constexpr char TRACE_MAGIC[8] = {'O', 'P', 'T', 'T', 'R', 'A', 'C', 'E'};
+    static constexpr uint32_t TRACE_VERSION = 1;
+
+    enum Event : uint8_t {
+        Pack = 1,
+        SolverCreated,
+        SolverFilled,
+        Solve,
+        Deliver
+    };
+
+    struct RecordHeader {
+        uint8_t event;
+        uint8_t kind;                            // 0 = min, 1 = cnt
+        uint16_t flags;
+        uint32_t arg;
+        uint64_t time;
+    };
+
+    ~TraceRecorder() {
+        close();
+    }
+
+    bool open(const std::string &fileName) {
+        close();
+        file = std::fopen(fileName.c_str(), "wb");
+        if (!file)
+            return false;
+        std::fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, file);
+        std::fwrite(&TRACE_VERSION, sizeof(TRACE_VERSION), 1, file);
+        return true;
+    }
+
+    void close() {
+        if (file)
+            std::fclose(file);
+        file = nullptr;
+    }
+
+    bool enabled() const {
+        return file;
+    }
+
+    void setEpoch() {
+        epoch = std::chrono::steady_clock::now();
+    }
+
+    uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void pack(uint32_t company, uint32_t seq, const CProblemPack &problemPack) {
+        if (!file)
+            return;
+        std::vector<uint32_t> payload = {seq, (uint32_t)problemPack.m_ProblemsMin.size(),
+                                         (uint32_t)problemPack.m_ProblemsCnt.size()};
+        for (const auto *problems : {&problemPack.m_ProblemsMin, &problemPack.m_ProblemsCnt})
+            for (const auto &polygon : *problems)
+                payload.push_back((uint32_t)polygon->m_Points.size());
+
+        std::lock_guard<std::mutex> lock(mtx);
+        writeHeader(Pack, 0, 0, company, now());
+        std::fwrite(payload.data(), sizeof(uint32_t), payload.size(), file);
+    }
+
+    void solverCreated(const std::string &type, bool usable) {
+        if (!file)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        writeHeader(SolverCreated, type == "cnt", 0, usable, now());
+    }
+
+    void solverFilled(const std::string &type, size_t capacity) {
+        if (!file)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        writeHeader(SolverFilled, type == "cnt", 0, (uint32_t)capacity, now());
+    }
+
+    void solve(const std::string &type, size_t polygons, bool native, uint64_t start) {
+        if (!file)
+            return;
+        uint64_t duration = now() - start;
+        std::lock_guard<std::mutex> lock(mtx);
+        writeHeader(Solve, type == "cnt", native, (uint32_t)polygons, start);
+        std::fwrite(&duration, sizeof(duration), 1, file);
+    }
+
+    void deliver(uint32_t company, uint32_t seq, uint64_t start) {
+        if (!file)
+            return;
+        uint64_t stall = now() - start;
+        std::lock_guard<std::mutex> lock(mtx);
+        writeHeader(Deliver, 0, 0, company, start);
+        std::fwrite(&seq, sizeof(seq), 1, file);
+        std::fwrite(&stall, sizeof(stall), 1, file);
+    }
+
+private:
+    std::FILE *file = nullptr;
+    std::mutex mtx;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    void writeHeader(Event event, uint8_t kind, uint16_t flags, uint32_t arg, uint64_t time) {
+        RecordHeader header{event, kind, flags, arg, time};
+        std::fwrite(&header, sizeof(header), 1, file);
+    }
+};
+
 class COptimizer {
 public:
     static bool usingProgtestSolver() {
         return true;
     }
     static void checkAlgorithmMin(APolygon p) {
+        p->m_TriangMin = NativeSolver(*p).minTriangulation();
     }
     static void checkAlgorithmCnt(APolygon p) {
+        p->m_TriangCnt = NativeSolver(*p).cntTriangulations();
     }
 
     void addCompany(ACompany company) {
-        companies.emplace_back(company);
+        companies.emplace_back(company, (uint32_t)companies.size());
+    }
+    /**
+     * Record a binary trace of the run into fileName, must be called before start().
+     */
+    bool enableTrace(const std::string &fileName) {
+        return trace.open(fileName);
+    }
+    /**
+     * Solve native batches in the given number of worker processes, must be called before start(). Polygons with
+     * at least minVertices points (0 = none) skip the progtest solvers and always go to the worker processes.
+     */
+    void setRemoteWorkers(int processes, size_t minVertices = 0) {
+        remoteProcesses = processes;
+        remoteMinVertices = minVertices;
+    }
+    /**
+     * Select the thread placement policy, must be called before start().
+     */
+    void setPlacement(PlacementPolicy policy) {
+        placement.policy = policy;
+    }
+    /**
+     * Serve all companies by a pool of count sender threads instead of one sender per company, must be called
+     * before start(). Each company is bound to one pooled sender, so its solvedPack is still called from a single
+     * thread. 0 (default) = dedicated sender threads.
+     */
+    void setSenderThreads(int count) {
+        senderPoolSize = std::max(0, count);
+    }
+    /**
+     * Create the progtest solvers by factory(type) instead of createProgtestMinSolver/createProgtestCntSolver, must be
+     * called before start(). The factory is called from the prefetch and receiver threads, used by the tests.
+     */
+    void setSolverFactory(std::function<AProgtestSolver(const std::string &type)> factory) {
+        solverFactory = std::move(factory);
+    }
+    PlacementStats placementStats() const {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        return placement;
     }
     void start(int workThreads) {
         activeReceivers = (int)companies.size();
         activeWorkers = workThreads;
+        planPlacement(workThreads);
+        trace.setEpoch();
+        // fork before any optimizer thread exists
+        if (remoteProcesses > 0 && !remoteWorkers.start(remoteProcesses))
+            remoteMinVertices = 0;
+        // not in the constructor, the solver factory may be set after it
+        solver_min = createSolver("min");
+        solver_cnt = createSolver("cnt");
 
-        for (int i = 0; i < workThreads; i++)
-            workerThreads.emplace_back(&COptimizer::workerFunction, this);
+        {
+            std::lock_guard<std::mutex> lock(queueMtx);
+            for (int i = 0; i < workThreads; i++)
+                spawnWorker();
+        }
+        prefetchThread = std::thread(&COptimizer::prefetchFunction, this);
+
+        if (senderPoolSize) {
+            size_t slotCnt = std::min<size_t>(senderPoolSize, companies.size());
+            for (size_t i = 0; i < slotCnt; i++)
+                senderSlots.emplace_back(std::make_unique<SenderSlot>());
+            for (size_t i = 0; i < companies.size(); i++) {
+                companies[i].sender = senderSlots[i % slotCnt].get();
+                companies[i].sender->companies.push_back(&companies[i]);
+            }
+            for (auto &slot : senderSlots)
+                senderThreads.emplace_back(&COptimizer::pooledSenderFunction, this, std::ref(*slot));
+        }
 
         for (auto &companyWrapper : companies) {
             receiverThreads.emplace_back(&COptimizer::receiverFunction, this, std::ref(companyWrapper));
-            senderThreads.emplace_back(&COptimizer::senderFunction, this, std::ref(companyWrapper));
+            if (!senderPoolSize)
+                senderThreads.emplace_back(&COptimizer::senderFunction, this, std::ref(companyWrapper));
         }
     }
+    /**
+     * Add worker threads while the optimizer is running. Fails once all companies stopped delivering packs,
+     * the remaining solvers are then left to the current workers.
+     */
+    bool addWorkers(int count) {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        if (!activeReceivers || count <= 0)
+            return false;
+
+        activeWorkers += count;
+        while (count--)
+            spawnWorker();
+        return true;
+    }
+    /**
+     * Ask up to count workers to exit. A worker only leaves between two solvers, so no queued solver is lost,
+     * and at least one worker is always kept. Returns the number of workers that will retire.
+     */
+    int retireWorkers(int count) {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        count = std::max(0, std::min(count, activeWorkers - retireRequests - 1));
+        retireRequests += count;
+        cv.notify_all();
+        return count;
+    }
+    LedgerStats ledgerStats(const std::string &type) const {
+        return (type == "min" ? ledgerMin : ledgerCnt).stats();
+    }
+    int workerCount() const {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        return activeWorkers - retireRequests;
+    }
     void stop() {
         for (auto &thread : receiverThreads)
             thread.join();
+        {
+            std::lock_guard<std::mutex> lock(poolMtx);
+            prefetchDone = true;
+            poolCv.notify_all();
+        }
         for (auto &thread : senderThreads)
             thread.join();
         for (auto &thread : workerThreads)
             thread.join();
+        if (prefetchThread.joinable())
+            prefetchThread.join();
+        remoteWorkers.stop();
+        trace.close();
     }
 
 private:
@@ -130,56 +904,240 @@ private:
     std::condition_variable cv;
     std::vector<CompanyWrapper> companies;
     std::vector<std::thread> workerThreads, receiverThreads, senderThreads;
-    std::mutex queueMtx;
+    int senderPoolSize = 0;
+    std::vector<std::unique_ptr<SenderSlot>> senderSlots;
+    mutable std::mutex queueMtx;
+    int retireRequests = 0;
     std::queue<shared_ptr<SolverWrapper>> solvers;
 
-    shared_ptr<SolverWrapper> solver_min = std::make_shared<SolverWrapper>("min", createProgtestMinSolver());
-    shared_ptr<SolverWrapper> solver_cnt = std::make_shared<SolverWrapper>("cnt", createProgtestCntSolver());
+    PlacementStats placement;
+    TraceRecorder trace;
+    std::vector<std::vector<int>> cores;
+    std::vector<int> coreLoad;
+
+    SolverLedger ledgerMin, ledgerCnt;
+    RemoteWorkers remoteWorkers;
+    std::function<AProgtestSolver(const std::string &type)> solverFactory;
+    int remoteProcesses = 0;
+    size_t remoteMinVertices = 0;
+
+    /**
+     * Ready pools of pre-created solvers, refilled by prefetchThread outside queueMtx, so a rollover is just
+     * a pointer swap. After start() only prefetchThread calls the factory, a rollover that finds the pool empty
+     * waits for it, so solvers are handed out in creation order and refilling stops once the kind is exhausted.
+     * Prefetching never skips a useful instance, but up to POOL_DEPTH instances per kind created from the factory's
+     * capacity stay unused at the end. The pool of an exhausted kind is discarded, a rejecting or miscalculating
+     * solver says nothing good about the instances created before it. prefetchDone is set by the last receiver, or
+     * by stop() without companies.
+     *
+     * Rollovers served without waiting in the 200-company test: 57 % with a depth of 1, 86 % with 2, 95 % with 4,
+     * 99.6 % with 8; 4 keeps the waste small.
+     */
+    static constexpr size_t POOL_DEPTH = 4;
+    std::mutex poolMtx;
+    std::condition_variable poolCv;
+    std::deque<shared_ptr<SolverWrapper>> poolMin, poolCnt;
+    bool prefetchDone = false;
+    std::thread prefetchThread;
+
+    shared_ptr<SolverWrapper> solver_min, solver_cnt;
+
+    void planPlacement(int workThreads) {
+        placement.workerCpus.clear();
+        placement.commCpus.clear();
+        if (placement.policy == PlacementPolicy::None)
+            return;
+
+        cores = detectPhysicalCores();
+        coreLoad.assign(cores.size(), 0);
+        placement.physicalCores = cores.size();
+
+        size_t workerCores = std::min<size_t>(workThreads, cores.size());
+        for (size_t i = workerCores; i < cores.size(); i++)
+            placement.commCpus.insert(placement.commCpus.end(), cores[i].begin(), cores[i].end());
+        if (placement.commCpus.empty())
+            for (size_t i = 0; i < workerCores; i++)
+                placement.commCpus.insert(placement.commCpus.end(), cores[i].begin() + 1, cores[i].end());
+    }
+
+    // queueMtx held
+    void spawnWorker() {
+        int core = -1;
+        if (!coreLoad.empty()) {
+            core = (int)(std::min_element(coreLoad.begin(), coreLoad.end()) - coreLoad.begin());
+            coreLoad[core]++;
+        }
+        placement.workerCpus.push_back(core < 0 ? -1 : cores[core].front());
+        workerThreads.emplace_back(&COptimizer::workerFunction, this, core);
+    }
+
+    void pinWorker(int core) {
+        if (core >= 0 && !pinCurrentThread({cores[core].front()}))
+            placement.pinFailures++;
+    }
+
+    void pinCommThread() {
+        if (!placement.commCpus.empty() && !pinCurrentThread(placement.commCpus))
+            placement.pinFailures++;
+    }
 
     void processProblems(const std::vector<APolygon>& problems,
                         shared_ptr<SolverWrapper>& solver,
                         const shared_ptr<ProblemPackWrapper>& pack,
                         const string& type) {
-        size_t count = 0;
+        SolverLedger &ledger = ledgerOf(type);
+        shared_ptr<SolverWrapper> large;
         for (const auto &polygon : problems) {
-            if (solver) {
-                solver->solver->addPolygon(polygon);
-                count++;
-                if (!solver->solver->hasFreeCapacity()) {
-                    solver->inSolver[pack] = count;
-                    count = 0;
-                    solvers.push(std::move(solver));
-                    cv.notify_all();
-                    type == "min" ? solver = std::make_shared<SolverWrapper>("min", createProgtestMinSolver()) :
-                                    solver = std::make_shared<SolverWrapper>("cnt", createProgtestCntSolver());
+            if (remoteMinVertices && polygon->m_Points.size() >= remoteMinVertices) {
+                if (!large) {
+                    large = std::make_shared<SolverWrapper>(type, nullptr, &ledger);
+                    large->remote = &remoteWorkers;
+                }
+                large->add(polygon);
+                large->inSolver[pack]++;
+                continue;
+            }
+
+            // once the kind is exhausted takeSolver hands out native batches, which accept every polygon
+            while (!solver->add(polygon)) {
+                ledger.rejected++;
+                ledger.exhausted = true;
+                rolloverSolver(solver, type);
+            }
+            solver->inSolver[pack]++;
+
+            if (solver->isFull()) {
+                if (!solver->isNative()) {
+                    ledger.filled++;
+                    ledger.capacity += solver->polygons.size();
+                    trace.solverFilled(type, solver->polygons.size());
                 }
+                rolloverSolver(solver, type);
             }
         }
-        if (count > 0)
-            solver->inSolver[pack] = count;
+
+        // native batches do not wait for further packs
+        if (solver->isNative() && !solver->polygons.empty())
+            rolloverSolver(solver, type);
+        if (large) {
+            solvers.push(std::move(large));
+            cv.notify_all();
+        }
+    }
+
+    void rolloverSolver(shared_ptr<SolverWrapper> &solver, const string &type) {
+        if (!solver->polygons.empty()) {
+            solvers.push(std::move(solver));
+            cv.notify_all();
+        }
+        solver = takeSolver(type);
+    }
+
+    shared_ptr<SolverWrapper> takeSolver(const string &type) {
+        SolverLedger &ledger = ledgerOf(type);
+        {
+            std::unique_lock<std::mutex> lock(poolMtx);
+            auto &pool = type == "min" ? poolMin : poolCnt;
+            // a miss waits for the prefetcher instead of calling the factory itself, a worker may exhaust the kind
+            // meanwhile without notifying poolCv, hence the timeout
+            bool waited = false;
+            while (pool.empty() && !ledger.exhausted && !prefetchDone) {
+                waited = true;
+                poolCv.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            if (ledger.exhausted)
+                pool.clear();
+            else if (!pool.empty()) {
+                auto solver = std::move(pool.front());
+                pool.pop_front();
+                (waited ? ledger.prefetchMisses : ledger.prefetchHits)++;
+                poolCv.notify_all();
+                return solver;
+            }
+        }
+        // a native batch, or the prefetcher is gone
+        return createSolver(type);
+    }
+
+    bool needsRefill(const string &type) {
+        return (type == "min" ? poolMin : poolCnt).size() < POOL_DEPTH && !ledgerOf(type).exhausted;
+    }
+
+    void prefetchFunction() {
+        pinCommThread();
+        std::unique_lock<std::mutex> lock(poolMtx);
+        while (true) {
+            poolCv.wait(lock, [this](){ return prefetchDone || needsRefill("min") || needsRefill("cnt"); });
+            if (prefetchDone)
+                return;
+
+            for (const char *type : {"min", "cnt"})
+                if (needsRefill(type)) {
+                    lock.unlock();
+                    auto solver = createSolver(type);
+                    lock.lock();
+                    (solver->type == "min" ? poolMin : poolCnt).push_back(std::move(solver));
+                    poolCv.notify_all();
+                }
+        }
+    }
+
+    shared_ptr<SolverWrapper> createSolver(const string &type) {
+        SolverLedger &ledger = ledgerOf(type);
+        AProgtestSolver solver;
+        if (!ledger.exhausted) {
+            if (solverFactory)
+                solver = solverFactory(type);
+            else
+                solver = type == "min" ? createProgtestMinSolver() : createProgtestCntSolver();
+            ledger.instances++;
+            if (!solver || !solver->hasFreeCapacity()) {
+                ledger.unusable++;
+                ledger.exhausted = true;
+                solver.reset();
+            }
+            trace.solverCreated(type, solver != nullptr);
+        }
+        auto wrapper = std::make_shared<SolverWrapper>(type, std::move(solver), &ledger);
+        wrapper->remote = &remoteWorkers;
+        return wrapper;
+    }
+
+    SolverLedger &ledgerOf(const string &type) {
+        return type == "min" ? ledgerMin : ledgerCnt;
     }
 
     void receiverFunction(CompanyWrapper &companyWrapper) {
+        pinCommThread();
         while (true) {
             AProblemPack problemPack = companyWrapper.company->waitForPack();
             if (!problemPack) {
                 --activeReceivers;
                 if (!activeReceivers) {
+                    {
+                        std::lock_guard<std::mutex> lock(poolMtx);
+                        prefetchDone = true;
+                        poolCv.notify_all();
+                    }
                     std::lock_guard<std::mutex> lock(queueMtx);
-                    if (solver_min)
+                    if (solver_min && !solver_min->polygons.empty())
                         solvers.push(std::move(solver_min));
 
-                    if (solver_cnt)
+                    if (solver_cnt && !solver_cnt->polygons.empty())
                         solvers.push(std::move(solver_cnt));
                 }
                 cv.notify_all();
                 return;
             }
             auto pack = std::make_shared<ProblemPackWrapper>(&companyWrapper, problemPack);
+            pack->seq = companyWrapper.packSeq++;
+            trace.pack(companyWrapper.id, pack->seq, *problemPack);
             {
                 std::lock_guard<std::mutex> lock(*companyWrapper.mtx);
                 companyWrapper.problemPacks.push(pack);
             }
+            if (pack->isSolved())
+                companyWrapper.notifySolved();
 
             std::lock_guard<std::mutex> lock(queueMtx);
             processProblems(problemPack->m_ProblemsMin, solver_min, pack,"min");
@@ -187,15 +1145,28 @@ private:
         }
     }
 
-    void workerFunction() {
+    void workerFunction(int core) {
+        pinWorker(core);
         while (true) {
             std::unique_lock<std::mutex> lock(queueMtx);
-            cv.wait(lock, [this](){ return !activeReceivers || !solvers.empty() || !activeWorkers; });
+            cv.wait(lock, [this](){ return !activeReceivers || !solvers.empty() || !activeWorkers || retireRequests; });
 
             if (!activeReceivers && solvers.empty()) {
                 --activeWorkers;
                 for (const auto &x : companies)
                     x.cv->notify_all();
+                for (const auto &slot : senderSlots) {
+                    std::lock_guard<std::mutex> slotLock(slot->mtx);
+                    slot->cv.notify_all();
+                }
+                return;
+            }
+
+            if (retireRequests) {
+                retireRequests--;
+                --activeWorkers;
+                if (core >= 0)
+                    coreLoad[core]--;
                 return;
             }
 
@@ -203,12 +1174,15 @@ private:
                 const auto solver = solvers.front();
                 solvers.pop();
                 lock.unlock();
+                uint64_t start = trace.enabled() ? trace.now() : 0;
                 solver->solveWrapper();
+                trace.solve(solver->type, solver->polygons.size(), solver->isNative(), start);
             }
         }
     }
 
-    void senderFunction(CompanyWrapper &companyWrapper) const {
+    void senderFunction(CompanyWrapper &companyWrapper) {
+        pinCommThread();
         while (true) {
             std::unique_lock<std::mutex> lock(*companyWrapper.mtx);
             companyWrapper.cv->wait(lock, [&](){ return !activeWorkers ||
@@ -217,29 +1191,162 @@ private:
             if (!activeWorkers && companyWrapper.problemPacks.empty())
                 return;
 
-            if (!companyWrapper.problemPacks.empty() && companyWrapper.problemPacks.front()->isSolved()) {
-                companyWrapper.company->solvedPack(companyWrapper.problemPacks.front()->problemPack);
-                companyWrapper.problemPacks.pop();
+            if (!companyWrapper.problemPacks.empty() && companyWrapper.problemPacks.front()->isSolved())
+                deliverFront(companyWrapper);
+        }
+    }
+
+    // companyWrapper.mtx held
+    void deliverFront(CompanyWrapper &companyWrapper) {
+        const auto &pack = companyWrapper.problemPacks.front();
+        uint64_t start = trace.enabled() ? trace.now() : 0;
+        companyWrapper.company->solvedPack(pack->problemPack);
+        trace.deliver(companyWrapper.id, pack->seq, start);
+        companyWrapper.problemPacks.pop();
+    }
+
+    void deliverSolved(CompanyWrapper &companyWrapper) {
+        std::lock_guard<std::mutex> lock(*companyWrapper.mtx);
+        while (!companyWrapper.problemPacks.empty() && companyWrapper.problemPacks.front()->isSolved())
+            deliverFront(companyWrapper);
+    }
+
+    void pooledSenderFunction(SenderSlot &slot) {
+        pinCommThread();
+        while (true) {
+            CompanyWrapper *companyWrapper;
+            {
+                std::unique_lock<std::mutex> lock(slot.mtx);
+                slot.cv.wait(lock, [&](){ return !slot.ready.empty() || !activeWorkers; });
+
+                if (slot.ready.empty())
+                    break;
+
+                companyWrapper = slot.ready.front();
+                slot.ready.pop_front();
+                // cleared before delivering, a pack solved meanwhile re-queues the company
+                companyWrapper->readyQueued = false;
             }
+            deliverSolved(*companyWrapper);
         }
+
+        // all workers are gone, every remaining pack is solved
+        for (auto *companyWrapper : slot.companies)
+            deliverSolved(*companyWrapper);
     }
 };
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 #ifndef __PROGTEST__
 
-int main() {
-    COptimizer optimizer;
+/**
+ * A CCompanyTest with its own copies of the g_Data polygons. CCompanyTest hands the g_Data polygons themselves to all
+ * companies, so results written back outside the progtest solvers (native, remote) race between the companies.
+ * The results are validated against the g_Data references the same way.
+ */
+class CCompanyCopy : public CCompany {
+public:
+    explicit CCompanyCopy(unsigned seed = std::random_device{}()) : m_Random(seed) {
+        for (const auto &data : g_Data) {
+            m_Min.push_back(copyPolygon(*data.m_Polygon));
+            m_Cnt.push_back(copyPolygon(*data.m_Polygon));
+        }
+    }
+
+    AProblemPack waitForPack() override {
+        if (m_MinPos == g_Data.size() && m_CntPos == g_Data.size())
+            return AProblemPack();
+
+        size_t nMin = std::min<size_t>(m_Random() % 4 + 1, g_Data.size() - m_MinPos);
+        size_t nCnt = std::min<size_t>(m_Random() % 4 + 1, g_Data.size() - m_CntPos);
+        auto pack = std::make_shared<CProblemPack>();
+        while (nMin--)
+            pack->addMin(m_Min[m_MinPos++]);
+        while (nCnt--)
+            pack->addCnt(m_Cnt[m_CntPos++]);
+        return pack;
+    }
+
+    void solvedPack(AProblemPack pack) override {
+        for (const auto &polygon : pack->m_ProblemsMin) {
+            size_t idx = m_MinDone++;
+            if (idx >= g_Data.size() || m_Min[idx] != polygon)
+                throw std::invalid_argument("solvedPack: order not preserved");
+            double ref = g_Data.begin()[idx].m_TriangMin;
+            if (std::fabs(polygon->m_TriangMin - ref) > 1e8 * DBL_EPSILON * std::fabs(ref))
+                throw std::invalid_argument("solvedPack: invalid result (TriangMin)");
+        }
+        for (const auto &polygon : pack->m_ProblemsCnt) {
+            size_t idx = m_CntDone++;
+            if (idx >= g_Data.size() || m_Cnt[idx] != polygon)
+                throw std::invalid_argument("solvedPack: order not preserved");
+            if (polygon->m_TriangCnt != CBigInt(g_Data.begin()[idx].m_TriangCnt))
+                throw std::invalid_argument("solvedPack: invalid result (TriangCnt)");
+        }
+    }
+
+    bool allProcessed() const {
+        return m_MinPos == g_Data.size() && m_MinDone == g_Data.size() && m_CntPos == g_Data.size()
+               && m_CntDone == g_Data.size();
+    }
+
+private:
+    std::mt19937 m_Random;
+    std::vector<APolygon> m_Min, m_Cnt;
+    size_t m_MinPos = 0, m_MinDone = 0, m_CntPos = 0, m_CntDone = 0;
+
+    static APolygon copyPolygon(const CPolygon &src) {
+        auto polygon = std::make_shared<CPolygon>();
+        for (const auto &point : src.m_Points)
+            polygon->add(point);
+        return polygon;
+    }
+};
+
+/**
+ * A progtest solver that solves its polygons with another one and then spoils every result.
+ */
+class CWrongSolver : public CProgtestSolver {
+public:
+    CWrongSolver(std::string type, AProgtestSolver solver) : m_Type(std::move(type)), m_Solver(std::move(solver)) {
+    }
+
+    bool hasFreeCapacity() const override {
+        return m_Solver->hasFreeCapacity();
+    }
+
+    bool addPolygon(APolygon polygon) override {
+        if (!m_Solver->addPolygon(polygon))
+            return false;
+        m_Polygons.push_back(std::move(polygon));
+        return true;
+    }
+
+    size_t solve() override {
+        size_t solved = m_Solver->solve();
+        for (const auto &polygon : m_Polygons)
+            m_Type == "min" ? polygon->m_TriangMin += 1 : polygon->m_TriangCnt += CBigInt(1);
+        return solved;
+    }
 
-    int companyNum = 200;
-    std::vector<ACompanyTest> companies;
+private:
+    std::string m_Type;
+    AProgtestSolver m_Solver;
+    std::vector<APolygon> m_Polygons;
+};
+
+template<typename TCompany = CCompanyTest>
+static void runCompanies(COptimizer &optimizer, int companyNum) {
+    std::vector<std::shared_ptr<TCompany>> companies;
     companies.reserve(companyNum + 1);
     for (int x = 0; x < companyNum; x++)
-        companies.push_back(std::make_shared<CCompanyTest>());
+        companies.push_back(std::make_shared<TCompany>());
     for (auto &x : companies)
         optimizer.addCompany(x);
 
     optimizer.start(5);
+    optimizer.addWorkers(3);
+    optimizer.retireWorkers(6);
     optimizer.stop();
 
     int cnt = 0;
@@ -250,6 +1357,227 @@ int main() {
         }
         cnt++;
     }
+}
+
+/**
+ * A CCompany that plays back the packs of one company from a TraceRecorder file: packs arrive at their recorded
+ * times with the recorded polygon sizes (regular convex polygons) and solvedPack stalls as long as the original.
+ * Results are not validated, only the order of the returned packs.
+ */
+class CCompanyReplay : public CCompany {
+public:
+    struct TracePack {
+        uint64_t arrival = 0;
+        uint64_t stall = 0;
+        std::vector<uint32_t> min, cnt;
+    };
+
+    CCompanyReplay(std::vector<TracePack> packs, std::chrono::steady_clock::time_point epoch)
+        : m_Packs(std::move(packs)), m_Epoch(epoch) {
+    }
+
+    AProblemPack waitForPack() override {
+        if (m_Next == m_Packs.size())
+            return AProblemPack();
+
+        const TracePack &src = m_Packs[m_Next++];
+        std::this_thread::sleep_until(m_Epoch + std::chrono::nanoseconds(src.arrival));
+        auto pack = std::make_shared<CProblemPack>();
+        for (uint32_t vertices : src.min)
+            pack->addMin(regularPolygon(vertices));
+        for (uint32_t vertices : src.cnt)
+            pack->addCnt(regularPolygon(vertices));
+        std::lock_guard<std::mutex> lock(m_Mtx);
+        m_Issued.push_back(pack);
+        return pack;
+    }
+
+    void solvedPack(AProblemPack pack) override {
+        std::unique_lock<std::mutex> lock(m_Mtx);
+        if (m_Done >= m_Issued.size() || m_Issued[m_Done] != pack)
+            throw std::invalid_argument("solvedPack: order not preserved");
+
+        const TracePack &src = m_Packs[m_Done++];
+        lock.unlock();
+        auto now = std::chrono::steady_clock::now() - m_Epoch;
+        m_Latency += std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - src.arrival;
+        std::this_thread::sleep_for(std::chrono::nanoseconds(src.stall));
+    }
+
+    bool allProcessed() const {
+        return m_Next == m_Packs.size() && m_Done == m_Packs.size();
+    }
+
+    uint64_t totalLatency() const {
+        return m_Latency;
+    }
+
+    static APolygon regularPolygon(uint32_t vertices) {
+        auto polygon = std::make_shared<CPolygon>();
+        for (uint32_t i = 0; i < vertices; i++) {
+            double angle = 2 * M_PI * i / vertices;
+            polygon->add(CPoint((int)std::lround(100000 * std::cos(angle)), (int)std::lround(100000 * std::sin(angle))));
+        }
+        return polygon;
+    }
+
+    static std::map<uint32_t, std::vector<TracePack>> loadTrace(const char *fileName) {
+        std::ifstream in(fileName, std::ios::binary);
+        char magic[sizeof(TraceRecorder::TRACE_MAGIC)];
+        uint32_t version;
+        if (!in.read(magic, sizeof(magic)) || !in.read((char *)&version, sizeof(version))
+            || !std::equal(magic, magic + sizeof(magic), TraceRecorder::TRACE_MAGIC)
+            || version != TraceRecorder::TRACE_VERSION)
+            throw std::invalid_argument("loadTrace: not a trace file");
+
+        std::map<uint32_t, std::vector<TracePack>> companies;
+        TraceRecorder::RecordHeader header;
+        while (in.read((char *)&header, sizeof(header))) {
+            switch (header.event) {
+                case TraceRecorder::Pack: {
+                    uint32_t hdr[3];
+                    in.read((char *)hdr, sizeof(hdr));
+                    auto &packs = companies[header.arg];
+                    if (packs.size() <= hdr[0])
+                        packs.resize(hdr[0] + 1);
+                    TracePack &pack = packs[hdr[0]];
+                    pack.arrival = header.time;
+                    pack.min.resize(hdr[1]);
+                    pack.cnt.resize(hdr[2]);
+                    in.read((char *)pack.min.data(), hdr[1] * sizeof(uint32_t));
+                    in.read((char *)pack.cnt.data(), hdr[2] * sizeof(uint32_t));
+                    break;
+                }
+                case TraceRecorder::Solve:
+                    in.ignore(sizeof(uint64_t));
+                    break;
+                case TraceRecorder::Deliver: {
+                    uint32_t seq;
+                    uint64_t stall;
+                    in.read((char *)&seq, sizeof(seq));
+                    in.read((char *)&stall, sizeof(stall));
+                    auto &packs = companies[header.arg];
+                    if (packs.size() <= seq)
+                        packs.resize(seq + 1);
+                    packs[seq].stall = stall;
+                    break;
+                }
+                case TraceRecorder::SolverCreated:
+                case TraceRecorder::SolverFilled:
+                    break;
+                default:
+                    throw std::invalid_argument("loadTrace: corrupted trace");
+            }
+        }
+        return companies;
+    }
+
+private:
+    std::vector<TracePack> m_Packs;
+    std::chrono::steady_clock::time_point m_Epoch;
+    std::mutex m_Mtx;
+    std::vector<AProblemPack> m_Issued;
+    size_t m_Next = 0;
+    size_t m_Done = 0;
+    uint64_t m_Latency = 0;
+};
+
+/**
+ * The native fallback: NativeSolver against the g_Data references, the bounds check of a batch too large to
+ * recompute, and a run whose progtest solvers spoil every result, which the spot check has to catch so that every
+ * polygon ends up solved natively.
+ */
+static void testNativeFallback() {
+    for (const auto &data : g_Data) {
+        NativeSolver native(*data.m_Polygon);
+        double ref = data.m_TriangMin;
+        if (std::fabs(native.minTriangulation() - ref) > 1e8 * DBL_EPSILON * std::fabs(ref)
+            || native.cntTriangulations() != CBigInt(data.m_TriangCnt))
+            throw std::logic_error("NativeSolver differs from the reference");
+    }
+
+    SolverLedger ledger;
+    for (const char *type : {"min", "cnt"}) {
+        SolverWrapper large(type, nullptr, &ledger);
+        large.polygons.push_back(CCompanyReplay::regularPolygon(SolverWrapper::SPOT_CHECK_VERTICES + 16));
+        if (large.spotCheck())
+            throw std::logic_error("Spot check accepted an empty result");
+        large.solveNative(large.polygons.front());
+        if (!large.spotCheck())
+            throw std::logic_error("Spot check rejected a native result");
+    }
+
+    COptimizer optimizer;
+    optimizer.setSolverFactory([](const std::string &type) -> AProgtestSolver {
+        AProgtestSolver solver = type == "min" ? createProgtestMinSolver() : createProgtestCntSolver();
+        return solver ? std::make_shared<CWrongSolver>(type, std::move(solver)) : nullptr;
+    });
+    runCompanies<CCompanyCopy>(optimizer, 20);
+    for (const char *type : {"min", "cnt"}) {
+        LedgerStats ledger = optimizer.ledgerStats(type);
+        if (!ledger.wrongResults || !ledger.exhausted || ledger.used || ledger.native != 20 * g_Data.size())
+            throw std::logic_error("Wrong progtest results were not replaced by native ones");
+    }
+}
+
+static int replayTrace(const char *fileName, int workThreads) {
+    auto trace = CCompanyReplay::loadTrace(fileName);
+    auto epoch = std::chrono::steady_clock::now();
+    COptimizer optimizer;
+    std::vector<std::shared_ptr<CCompanyReplay>> companies;
+    size_t packs = 0;
+    for (auto &[id, companyPacks] : trace) {
+        packs += companyPacks.size();
+        companies.push_back(std::make_shared<CCompanyReplay>(std::move(companyPacks), epoch));
+        optimizer.addCompany(companies.back());
+    }
+
+    optimizer.start(workThreads);
+    optimizer.stop();
+
+    uint64_t latency = 0;
+    for (const auto &x : companies) {
+        if (!x->allProcessed())
+            throw std::logic_error("Replay: some packs were not returned");
+        latency += x->totalLatency();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+    printf("Replayed %zu packs of %zu companies in %.3f s, mean pack latency %.3f ms\n",
+           packs, companies.size(), elapsed, packs ? latency / 1e6 / packs : 0.0);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // --record <file> traces the first test run, --replay <file> plays a recorded trace back
+    if (argc == 3 && !strcmp(argv[1], "--replay"))
+        return replayTrace(argv[2], 5);
+
+    {
+        COptimizer optimizer;
+        optimizer.setPlacement(PlacementPolicy::Spread);
+        if (argc == 3 && !strcmp(argv[1], "--record") && !optimizer.enableTrace(argv[2]))
+            throw std::runtime_error("Cannot create the trace file");
+        runCompanies(optimizer, 200);
+
+        PlacementStats placement = optimizer.placementStats();
+        printf("Placement: %zu physical cores, %zu pinned comm CPUs, %zu pin failures\n",
+               placement.physicalCores, placement.commCpus.size(), placement.pinFailures.load());
+    }
+    {
+        COptimizer optimizer;
+        optimizer.setSenderThreads(4);
+        // the remote results are written back outside the progtest solvers, each company needs its own polygons
+        optimizer.setRemoteWorkers(2, 30);
+        runCompanies<CCompanyCopy>(optimizer, 200);
+
+        for (const char *type : {"min", "cnt"}) {
+            LedgerStats ledger = optimizer.ledgerStats(type);
+            printf("Ledger %s: %zu solvers (%zu unusable, %zu prefetched, %zu waited for), %zu polygons by progtest solvers, %zu native, %zu remote\n",
+                   type, ledger.instances, ledger.unusable, ledger.prefetchHits, ledger.prefetchMisses, ledger.used, ledger.native,
+                   ledger.remote);
+        }
+    }
+    testNativeFallback();
     printf("All companies processed\n");
     return 0;
 }
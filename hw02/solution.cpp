@@ -31,41 +31,2323 @@ struct TBlkDev {
 
 #endif /* __PROGTEST__ */
 
+// not part of the progtest header set
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_KERNEL_X86
+#endif
+
+//-------------------------------------------------------------------------------------------------
+/**
+ * Parity kernels: dst = src[0] ^ src[1] ^ ... ^ src[srcCnt - 1] over len bytes (a multiple of 64) in a single pass
+ * over the buffers. dst may be one of the sources. The variant (AVX2, SSE2 or scalar) is picked at startup from the
+ * features of the CPU, see xorBlocks.
+ */
+using XorKernel = void (*)(uint8_t *dst, const uint8_t *const *src, int srcCnt, size_t len);
+
+static void xorBlocksScalar(uint8_t *dst, const uint8_t *const *src, int srcCnt, size_t len){
+    for (size_t off = 0; off < len; off += 4 * sizeof(uint64_t)) {
+        uint64_t acc[4];
+        memcpy(acc, src[0] + off, sizeof(acc));
+        for (int s = 1; s < srcCnt; s++) {
+            uint64_t x[4];
+            memcpy(x, src[s] + off, sizeof(x));
+            for (int i = 0; i < 4; i++)
+                acc[i] ^= x[i];
+        }
+        memcpy(dst + off, acc, sizeof(acc));
+    }
+}
+
+#ifdef XOR_KERNEL_X86
+__attribute__((target("sse2")))
+static void xorBlocksSse2(uint8_t *dst, const uint8_t *const *src, int srcCnt, size_t len){
+    for (size_t off = 0; off < len; off += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(src[0] + off));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(src[0] + off + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(src[0] + off + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *)(src[0] + off + 48));
+        for (int s = 1; s < srcCnt; s++) {
+            a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(src[s] + off)));
+            a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(src[s] + off + 16)));
+            a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(src[s] + off + 32)));
+            a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(src[s] + off + 48)));
+        }
+        _mm_storeu_si128((__m128i *)(dst + off), a0);
+        _mm_storeu_si128((__m128i *)(dst + off + 16), a1);
+        _mm_storeu_si128((__m128i *)(dst + off + 32), a2);
+        _mm_storeu_si128((__m128i *)(dst + off + 48), a3);
+    }
+}
+
+__attribute__((target("avx2")))
+static void xorBlocksAvx2(uint8_t *dst, const uint8_t *const *src, int srcCnt, size_t len){
+    size_t off = 0;
+    for (; off + 128 <= len; off += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(src[0] + off));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(src[0] + off + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(src[0] + off + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(src[0] + off + 96));
+        for (int s = 1; s < srcCnt; s++) {
+            a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(src[s] + off)));
+            a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(src[s] + off + 32)));
+            a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(src[s] + off + 64)));
+            a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(src[s] + off + 96)));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + off), a0);
+        _mm256_storeu_si256((__m256i *)(dst + off + 32), a1);
+        _mm256_storeu_si256((__m256i *)(dst + off + 64), a2);
+        _mm256_storeu_si256((__m256i *)(dst + off + 96), a3);
+    }
+    if (off < len) {
+        const uint8_t *tail[MAX_RAID_DEVICES + 2];
+        for (int s = 0; s < srcCnt; s++)
+            tail[s] = src[s] + off;
+        xorBlocksSse2(dst + off, tail, srcCnt, len - off);
+    }
+}
+#endif
+
+static XorKernel selectXorKernel(){
+#ifdef XOR_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return xorBlocksAvx2;
+    if (__builtin_cpu_supports("sse2"))
+        return xorBlocksSse2;
+#endif
+    return xorBlocksScalar;
+}
+
+static const XorKernel xorBlocks = selectXorKernel();
+
+//-------------------------------------------------------------------------------------------------
+/**
+ * GF(2^8) over the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d) with the generator g = 2, the field of the RAID6
+ * Q parity. Products come from log/exp tables, mul[c] maps every byte to its product with c, so a region is
+ * multiplied by a constant with one lookup per byte.
+ */
+struct GfTables {
+    uint8_t exp[2 * 255];                           // exp[i] = g^i, doubled so that log a + log b needs no modulo
+    uint8_t log[256];
+    uint8_t mul[256][256];
+
+    GfTables(){
+        for (int i = 0, x = 1; i < 255; i++, x = x << 1 ^ (x & 0x80 ? 0x11d : 0)) {
+            exp[i] = exp[i + 255] = (uint8_t)x;
+            log[x] = (uint8_t)i;
+        }
+        log[0] = 0;
+        for (int a = 0; a < 256; a++)
+            for (int b = 0; b < 256; b++)
+                mul[a][b] = a && b ? exp[log[a] + log[b]] : 0;
+    }
+
+    uint8_t pow(int i) const{
+        return exp[i % 255];
+    }
+
+    uint8_t inv(uint8_t a) const{
+        return exp[255 - log[a]];
+    }
+};
+
+static const GfTables gf;
+
+// dst = c * src over len bytes, dst may be src
+static void gfMulBlocks(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len){
+    const uint8_t *table = gf.mul[c];
+    for (size_t i = 0; i < len; i++)
+        dst[i] = table[src[i]];
+}
+
+// dst ^= c * src over len bytes
+static void gfMulXorBlocks(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len){
+    const uint8_t *table = gf.mul[c];
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= table[src[i]];
+}
+
+/**
+ * RAID6 syndrome kernels: p = src[0] ^ ... ^ src[srcCnt - 1] and q = g^0 src[0] ^ ... ^ g^(srcCnt - 1) src[srcCnt - 1]
+ * over len bytes (a multiple of 64), a null source counts as zeros. q is evaluated by Horner's rule from the last
+ * source, q = q * g ^ src[i], and the multiplication by g = 2 is a shift plus a conditional xor of 0x1d in every byte,
+ * so Q costs about as much as P. The variant is picked like the parity kernel, see genSyndrome.
+ */
+using SyndromeKernel = void (*)(uint8_t *p, uint8_t *q, const uint8_t *const *src, int srcCnt, size_t len);
+
+static void genSyndromeScalar(uint8_t *p, uint8_t *q, const uint8_t *const *src, int srcCnt, size_t len){
+    for (size_t off = 0; off < len; off += sizeof(uint64_t)) {
+        uint64_t wp = 0, wq = 0;
+        for (int s = srcCnt - 1; s >= 0; s--) {
+            uint64_t high = wq & 0x8080808080808080ull;
+            wq = (wq << 1 & 0xfefefefefefefefeull) ^ (high >> 7) * 0x1d;
+            if (src[s]) {
+                uint64_t x;
+                memcpy(&x, src[s] + off, sizeof(x));
+                wp ^= x;
+                wq ^= x;
+            }
+        }
+        memcpy(p + off, &wp, sizeof(wp));
+        memcpy(q + off, &wq, sizeof(wq));
+    }
+}
+
+#ifdef XOR_KERNEL_X86
+__attribute__((target("sse2")))
+static void genSyndromeSse2(uint8_t *p, uint8_t *q, const uint8_t *const *src, int srcCnt, size_t len){
+    const __m128i poly = _mm_set1_epi8(0x1d), zero = _mm_setzero_si128();
+    for (size_t off = 0; off < len; off += 64) {
+        __m128i wp[4] = {zero, zero, zero, zero}, wq[4] = {zero, zero, zero, zero};
+        for (int s = srcCnt - 1; s >= 0; s--)
+            for (int i = 0; i < 4; i++) {
+                __m128i high = _mm_cmpgt_epi8(zero, wq[i]);
+                wq[i] = _mm_xor_si128(_mm_add_epi8(wq[i], wq[i]), _mm_and_si128(high, poly));
+                if (src[s]) {
+                    __m128i x = _mm_loadu_si128((const __m128i *)(src[s] + off) + i);
+                    wp[i] = _mm_xor_si128(wp[i], x);
+                    wq[i] = _mm_xor_si128(wq[i], x);
+                }
+            }
+        for (int i = 0; i < 4; i++) {
+            _mm_storeu_si128((__m128i *)(p + off) + i, wp[i]);
+            _mm_storeu_si128((__m128i *)(q + off) + i, wq[i]);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void genSyndromeAvx2(uint8_t *p, uint8_t *q, const uint8_t *const *src, int srcCnt, size_t len){
+    const __m256i poly = _mm256_set1_epi8(0x1d), zero = _mm256_setzero_si256();
+    for (size_t off = 0; off < len; off += 64) {
+        __m256i wp[2] = {zero, zero}, wq[2] = {zero, zero};
+        for (int s = srcCnt - 1; s >= 0; s--)
+            for (int i = 0; i < 2; i++) {
+                __m256i high = _mm256_cmpgt_epi8(zero, wq[i]);
+                wq[i] = _mm256_xor_si256(_mm256_add_epi8(wq[i], wq[i]), _mm256_and_si256(high, poly));
+                if (src[s]) {
+                    __m256i x = _mm256_loadu_si256((const __m256i *)(src[s] + off) + i);
+                    wp[i] = _mm256_xor_si256(wp[i], x);
+                    wq[i] = _mm256_xor_si256(wq[i], x);
+                }
+            }
+        for (int i = 0; i < 2; i++) {
+            _mm256_storeu_si256((__m256i *)(p + off) + i, wp[i]);
+            _mm256_storeu_si256((__m256i *)(q + off) + i, wq[i]);
+        }
+    }
+}
+#endif
+
+static SyndromeKernel selectSyndromeKernel(){
+#ifdef XOR_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return genSyndromeAvx2;
+    if (__builtin_cpu_supports("sse2"))
+        return genSyndromeSse2;
+#endif
+    return genSyndromeScalar;
+}
+
+static const SyndromeKernel genSyndrome = selectSyndromeKernel();
+
+//-------------------------------------------------------------------------------------------------
+/**
+ * On-disk metadata, stored in the last sector of every member device.
+ */
+struct RaidSuperblock {
+    static constexpr uint32_t MAGIC = 0x52414935;   // "RAI5"
+
+    uint32_t magic;
+    uint16_t device;                                // index of this member
+    uint16_t devices;                               // number of members
+    uint64_t uuid;                                  // identity of the volume, chosen by create()
+    uint64_t generation;                            // bumped by every metadata update, a stale member lags behind
+    uint32_t clean;                                 // the write-intent bitmap is empty, start() need not read it
+    uint16_t chunk;                                 // sectors of a member in one stripe
+    uint16_t layout;                                // placement of parity and data in a stripe
+    uint16_t level;                                 // 5 or 6
+};
+
+static_assert(sizeof(RaidSuperblock) <= SECTOR_SIZE);
+
+//-------------------------------------------------------------------------------------------------
+/**
+ * Latency histogram with power-of-two buckets: bucket 0 counts the samples under 1 us, bucket i > 0 those of
+ * [2^(i-1), 2^i) us, the last one also everything longer.
+ */
+struct LatencyHistogram {
+    static constexpr int BUCKETS = 28;
+
+    uint64_t m_Count[BUCKETS] = {};
+
+    static int bucket(std::chrono::steady_clock::duration latency){
+        auto us = (uint64_t)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+        return std::min(BUCKETS - 1, (int)std::bit_width(us));
+    }
+
+    uint64_t samples() const{
+        uint64_t total = 0;
+        for (uint64_t count : m_Count)
+            total += count;
+        return total;
+    }
+
+    /**
+     * Upper bound in microseconds of the bucket holding the q-quantile of the samples, 0 without samples.
+     */
+    uint64_t quantile(double q) const{
+        uint64_t total = samples(), seen = 0;
+        for (int i = 0; i < BUCKETS && total; i++)
+            if ((seen += m_Count[i]) >= q * total)
+                return (uint64_t)1 << i;
+        return 0;
+    }
+};
+
+// LatencyHistogram filled concurrently
+struct AtomicHistogram {
+    std::atomic<uint64_t> m_Count[LatencyHistogram::BUCKETS];
+
+    void add(std::chrono::steady_clock::duration latency){
+        m_Count[LatencyHistogram::bucket(latency)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void addTo(LatencyHistogram &histogram) const{
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++)
+            histogram.m_Count[i] += m_Count[i].load(std::memory_order_relaxed);
+    }
+
+    void reset(){
+        for (auto &count : m_Count)
+            count.store(0, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * I/O statistics of a volume since start() or resetStats(), see CRaidVolume::stats(). Logical sectors are those of
+ * the requests, physical ones those of the m_Read / m_Write calls including the metadata updates.
+ */
+struct RaidStats {
+    struct Device {
+        uint64_t m_ReadCalls = 0;
+        uint64_t m_ReadSectors = 0;
+        uint64_t m_WriteCalls = 0;
+        uint64_t m_WriteSectors = 0;
+        uint64_t m_Errors = 0;                      // calls that did not transfer all sectors
+        LatencyHistogram m_Latency;                 // of the m_Read / m_Write calls
+    };
+
+    std::vector<Device> m_Devices;
+    uint64_t m_ReadRequests = 0;
+    uint64_t m_ReadSectors = 0;
+    uint64_t m_WriteRequests = 0;
+    uint64_t m_WriteSectors = 0;
+    uint64_t m_FullStripeRows = 0;                  // rows written by each parity update mode
+    uint64_t m_ReadModifyWriteRows = 0;
+    uint64_t m_ReconstructWriteRows = 0;
+    uint64_t m_RecoverWriteRows = 0;
+    uint64_t m_NoParityRows = 0;
+    uint64_t m_RecoveredWindows = 0;                // windows of failed members recovered by degraded reads
+    uint64_t m_ReconHits = 0;                       // sectors of failed members served by the reconstruction cache
+    uint64_t m_CacheReadHits = 0;                   // sectors read from the write-back cache
+    uint64_t m_CacheWriteHits = 0;                  // sectors written to an already cached row
+    uint64_t m_CacheWriteMisses = 0;                // sectors that brought a row into the cache
+    uint64_t m_CacheEvictions = 0;
+    uint64_t m_ResyncRows = 0;                      // rows passed by the resync cursor
+    uint64_t m_ReadAheadSectors = 0;                // sectors prefetched beyond the requests
+    uint64_t m_ReadAheadHits = 0;                   // sectors served from the prefetched ones
+    double m_ResyncProgress = 1;
+    LatencyHistogram m_ReadLatency;                 // of read() and write()
+    LatencyHistogram m_WriteLatency;
+
+    uint64_t physicalReadSectors() const{
+        uint64_t total = 0;
+        for (const auto &device : m_Devices)
+            total += device.m_ReadSectors;
+        return total;
+    }
+
+    uint64_t physicalWriteSectors() const{
+        uint64_t total = 0;
+        for (const auto &device : m_Devices)
+            total += device.m_WriteSectors;
+        return total;
+    }
+
+    double readAmplification() const{
+        return m_ReadSectors ? (double)physicalReadSectors() / m_ReadSectors : 0;
+    }
+
+    double writeAmplification() const{
+        return m_WriteSectors ? (double)physicalWriteSectors() / m_WriteSectors : 0;
+    }
+};
+
+//-------------------------------------------------------------------------------------------------
+/**
+ * Per-device I/O dispatch: every member device has a worker thread with its own submission queue. run() fans a set
+ * of transfers out to the workers of their devices and returns when all of them are done, so a request spanning
+ * all devices costs about the latency of the slowest device instead of the sum. Transfers of one device are issued
+ * in submission order and never overlap, run() may be called from several threads.
+ */
+class IoEngine {
+public:
+    struct Transfer {
+        int device;
+        bool write;
+        int sector;
+        uint8_t *data;
+        int cnt;
+        bool ok = false;
+    };
+
+    IoEngine() = default;
+    IoEngine(const IoEngine &) = delete;
+    IoEngine &operator=(const IoEngine &) = delete;
+
+    ~IoEngine(){
+        stop();
+    }
+
+    void start(const TBlkDev &dev){
+        stop();
+        m_Dev = dev;
+        m_Counters.clear();
+        for (int d = 0; d < dev.m_Devices; d++) {
+            m_Counters.push_back(std::make_unique<DeviceCounters>());
+            m_Queues.push_back(std::make_unique<Queue>());
+            m_Queues.back()->thread = std::thread(&IoEngine::workerFunction, this, m_Queues.back().get());
+        }
+    }
+
+    void stop(){
+        for (auto &queue : m_Queues) {
+            {
+                std::lock_guard lock(queue->mtx);
+                queue->quit = true;
+            }
+            queue->cv.notify_one();
+            queue->thread.join();
+        }
+        m_Queues.clear();
+    }
+
+    /**
+     * Execute the transfers and set their ok flags. Transfers of a single device are executed by the calling thread,
+     * there is nothing to overlap.
+     */
+    void run(std::vector<Transfer> &transfers){
+        if (transfers.empty())
+            return;
+        bool single = std::all_of(transfers.begin(), transfers.end(), [&](const Transfer &t){
+            return t.device == transfers.front().device;
+        });
+        if (m_Queues.empty()) {
+            for (auto &t : transfers)
+                execute(t);
+            return;
+        }
+        if (single) {
+            std::lock_guard lock(m_Queues[transfers.front().device]->busy);
+            for (auto &t : transfers)
+                execute(t);
+            return;
+        }
+
+        Group group;
+        group.pending = (int)transfers.size();
+        for (auto &t : transfers) {
+            Queue &queue = *m_Queues[t.device];
+            {
+                std::lock_guard lock(queue.mtx);
+                queue.jobs.push_back({&t, &group});
+            }
+            queue.cv.notify_one();
+        }
+
+        std::unique_lock lock(group.mtx);
+        group.cv.wait(lock, [&](){ return group.pending == 0; });
+    }
+
+    // the counters of the calls since start(), they survive stop()
+    void stats(RaidStats &stats) const{
+        stats.m_Devices.assign(m_Counters.size(), {});
+        for (size_t d = 0; d < m_Counters.size(); d++) {
+            const DeviceCounters &counters = *m_Counters[d];
+            RaidStats::Device &device = stats.m_Devices[d];
+            device.m_ReadCalls = counters.readCalls.load(std::memory_order_relaxed);
+            device.m_ReadSectors = counters.readSectors.load(std::memory_order_relaxed);
+            device.m_WriteCalls = counters.writeCalls.load(std::memory_order_relaxed);
+            device.m_WriteSectors = counters.writeSectors.load(std::memory_order_relaxed);
+            device.m_Errors = counters.errors.load(std::memory_order_relaxed);
+            counters.latency.addTo(device.m_Latency);
+        }
+    }
+
+    void resetStats(){
+        for (auto &counters : m_Counters) {
+            for (auto *counter : {&counters->readCalls, &counters->readSectors, &counters->writeCalls,
+                                  &counters->writeSectors, &counters->errors})
+                counter->store(0, std::memory_order_relaxed);
+            counters->latency.reset();
+        }
+    }
+
+private:
+    // updated by the one thread that runs the transfers of the device at a time
+    struct DeviceCounters {
+        std::atomic<uint64_t> readCalls;
+        std::atomic<uint64_t> readSectors;
+        std::atomic<uint64_t> writeCalls;
+        std::atomic<uint64_t> writeSectors;
+        std::atomic<uint64_t> errors;
+        AtomicHistogram latency;
+    };
+
+    struct Group {
+        std::mutex mtx;
+        std::condition_variable cv;
+        int pending = 0;
+    };
+
+    struct Job {
+        Transfer *transfer;
+        Group *group;
+    };
+
+    struct Queue {
+        std::mutex mtx;
+        std::mutex busy;                            // held while a transfer of the device runs
+        std::condition_variable cv;
+        std::deque<Job> jobs;
+        bool quit = false;
+        std::thread thread;
+    };
+
+    TBlkDev m_Dev{};
+    std::vector<std::unique_ptr<Queue>> m_Queues;
+    std::vector<std::unique_ptr<DeviceCounters>> m_Counters;
+
+    void execute(Transfer &t){
+        auto start = std::chrono::steady_clock::now();
+        int done = t.write ? m_Dev.m_Write(t.device, t.sector, t.data, t.cnt) : m_Dev.m_Read(t.device, t.sector, t.data, t.cnt);
+        t.ok = done == t.cnt;
+        if (t.device >= (int)m_Counters.size())
+            return;
+        DeviceCounters &counters = *m_Counters[t.device];
+        (t.write ? counters.writeCalls : counters.readCalls).fetch_add(1, std::memory_order_relaxed);
+        (t.write ? counters.writeSectors : counters.readSectors).fetch_add(std::max(0, done), std::memory_order_relaxed);
+        if (!t.ok)
+            counters.errors.fetch_add(1, std::memory_order_relaxed);
+        counters.latency.add(std::chrono::steady_clock::now() - start);
+    }
+
+    void workerFunction(Queue *queue){
+        while (true) {
+            Job job;
+            {
+                std::unique_lock lock(queue->mtx);
+                queue->cv.wait(lock, [&](){ return queue->quit || !queue->jobs.empty(); });
+                if (queue->jobs.empty())
+                    return;
+                job = queue->jobs.front();
+                queue->jobs.pop_front();
+            }
+
+            {
+                std::lock_guard lock(queue->busy);
+                execute(*job.transfer);
+            }
+            std::lock_guard lock(job.group->mtx);
+            if (--job.group->pending == 0)
+                job.group->cv.notify_one();
+        }
+    }
+};
+
+//-------------------------------------------------------------------------------------------------
+/**
+ * Event counters of a volume in STAT_SHARDS cache-line aligned shards of relaxed atomics. A thread always adds to
+ * the shard picked at its first use, so concurrent requests rarely share a cache line and the counters can stay
+ * enabled. Reading sums the shards.
+ */
+class StatCounters {
+public:
+    enum Counter {
+        ReadRequests, ReadSectors, WriteRequests, WriteSectors,
+        FullStripeRows, ReadModifyWriteRows, ReconstructWriteRows, RecoverWriteRows, NoParityRows,
+        RecoveredWindows, ReconHits, CacheReadHits, CacheWriteHits, CacheWriteMisses, CacheEvictions, ResyncRows,
+        ReadAheadSectors, ReadAheadHits,
+        COUNTERS
+    };
+
+    void add(Counter counter, uint64_t n = 1){
+        shard().m_Counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void addLatency(bool write, std::chrono::steady_clock::duration latency){
+        shard().m_Latency[write].add(latency);
+    }
+
+    uint64_t get(Counter counter) const{
+        uint64_t total = 0;
+        for (const auto &shard : m_Shards)
+            total += shard.m_Counters[counter].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    LatencyHistogram latency(bool write) const{
+        LatencyHistogram histogram;
+        for (const auto &shard : m_Shards)
+            shard.m_Latency[write].addTo(histogram);
+        return histogram;
+    }
+
+    void reset(){
+        for (auto &shard : m_Shards) {
+            for (auto &counter : shard.m_Counters)
+                counter.store(0, std::memory_order_relaxed);
+            shard.m_Latency[0].reset();
+            shard.m_Latency[1].reset();
+        }
+    }
+
+private:
+    static constexpr int STAT_SHARDS = 16;
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> m_Counters[COUNTERS];
+        AtomicHistogram m_Latency[2];               // read, write
+    };
+
+    Shard m_Shards[STAT_SHARDS];
+
+    Shard &shard(){
+        static std::atomic<int> threads = 0;
+        thread_local int index = threads++ % STAT_SHARDS;
+        return m_Shards[index];
+    }
+};
+
+/**
+ * Software RAID5 or RAID6 over TBlkDev. The last META_SECTORS sectors of every device hold the metadata (a
+ * write-intent bitmap followed by the superblock), the remaining sectors are rows: row r stores the parity on
+ * device parityDevice(r), in RAID6 also the Q parity on device qDevice(r), and m_Devices - m_Parity data sectors on
+ * the other devices. A stripe is m_Chunk consecutive rows with the same parity devices, every data device holds a
+ * chunk of m_Chunk consecutive logical sectors in it, so a sequential request moves whole chunks per m_Read /
+ * m_Write call. The parity rotates from the last device to the first stripe by stripe, the data chunks either fill
+ * the other devices from device 0 (left-asymmetric) or start right after the parity devices and wrap around
+ * (left-symmetric), which spreads sequential reads over all devices. Level, chunk size and layout are chosen by
+ * create() and recorded in the superblock. Every metadata update moves the members to a new generation, start()
+ * reads just the superblocks and treats a member of an older generation as stale.
+ *
+ * The P parity is the xor of the data sectors, the Q parity their Reed-Solomon syndrome sum g^i D_i over GF(2^8).
+ * Up to m_Parity members may fail (m_FailedMask), their sectors are recovered from the others by recover().
+ *
+ * A bit of the write-intent bitmap covers REGION_ROWS rows. It is set and persisted before the region is written
+ * and cleared lazily once the region has not been written for a whole SWEEP_PERIOD, and only when no member is
+ * failed. The period is time, not a count of writes, so a region that is written every now and then keeps its bit
+ * instead of paying a metadata store before each write. The set bits bound the work after a failure: an unclean start
+ * recomputes the parity of the marked regions only, and resync() of a member that returns with its own metadata
+ * rebuilds only the marked regions.
+ *
+ * Requests are processed in batches of whole stripes of at most BATCH_ROWS rows. A batch is mapped onto contiguous row runs per
+ * device, so every device is touched by one m_Read / m_Write call per run instead of one call per sector. The
+ * calls of different devices are issued concurrently by the IoEngine.
+ *
+ * Writes that cover only part of a stripe may be absorbed by a write-back cache of up to m_CacheRows rows (LRU), it is
+ * off unless enabled by setCacheRows(). Repeated and adjacent small writes are merged there and reach the devices when
+ * a row is evicted and on stop(); a row completed in the cache is flushed as a full-stripe write without any reads.
+ * With the cache enabled a successful write() is no longer durable: the dirty rows are lost if the volume is
+ * destroyed without stop() or fails (RAID_FAILED) before they are flushed.
+ *
+ * read(), write() and resync() may be called concurrently. Rows are guarded by a table of LOCK_SLOTS reader/writer
+ * locks (row group r / LOCK_ROWS maps to slot group % LOCK_SLOTS): a write holds the slots of its rows exclusively
+ * from the parity reads to the last device write, so a stripe is never updated by two requests at once, a read holds
+ * them shared. Requests of different row groups run in parallel. m_Mtx guards the state shared by all rows (status,
+ * bitmap, caches, resync bookkeeping) and is held only briefly, never while waiting for a row lock. The metadata is
+ * written after m_Mtx is released, by flushMetadata() under m_MetaMtx, so a write that sets a new bit waits for its
+ * own metadata store only. start(), stop() and setCacheRows() exclude all requests through m_OpMtx.
+ *
+ * stats() reports what the volume did to the devices: the calls, sectors and latencies of every member from the
+ * IoEngine, the requests, parity update modes, degraded recoveries and cache hits from m_Stats.
+ *
+ * resync() rebuilds all failed members together in the background. Until the rebuild completes the volume is
+ * degraded, but the failed members are used as healthy ones below the resync cursor. The rebuild is a pipeline of
+ * survivor reads, reconstruction and writes to the new members, see resyncFunction().
+ */
 class CRaidVolume {
 public:
-    static bool create(const TBlkDev &dev){
+    static constexpr int LAYOUT_LEFT_ASYMMETRIC = 0;
+    static constexpr int LAYOUT_LEFT_SYMMETRIC = 1;
+    static constexpr int MAX_CHUNK_SECTORS = 128;
+
+    CRaidVolume() = default;
+
+    ~CRaidVolume(){
+        stopResync();
+    }
+
+    /**
+     * Initialize the members for a volume of stripes with chunks of chunkSectors sectors per device, large chunks
+     * suit large sequential requests, small ones spread small random requests. layout is one of LAYOUT_*, level 6
+     * adds the Q parity, so the volume survives two failed members.
+     */
+    static bool create(const TBlkDev &dev, int chunkSectors = 1, int layout = LAYOUT_LEFT_ASYMMETRIC, int level = 5){
+        if (!validGeometry(dev) || !validLayout(dev, chunkSectors, layout, level))
+            return false;
+
+        // zeroed data and parity are consistent, the bitmap is clear
+        std::random_device random;
+        uint64_t uuid = (uint64_t)random() << 32 | random();
+        std::vector<uint8_t> zero(BATCH_ROWS * SECTOR_SIZE, 0);
+        int rows = dataRows(dev, chunkSectors);
+        for (int d = 0; d < dev.m_Devices; d++) {
+            for (int row = 0; row < rows; row += BATCH_ROWS) {
+                int cnt = std::min(BATCH_ROWS, rows - row);
+                if (dev.m_Write(d, row, zero.data(), cnt) != cnt)
+                    return false;
+            }
 
+            std::vector<uint8_t> meta(META_SECTORS * SECTOR_SIZE, 0);
+            RaidSuperblock sb{RaidSuperblock::MAGIC, (uint16_t)d, (uint16_t)dev.m_Devices, uuid, 1, 1,
+                              (uint16_t)chunkSectors, (uint16_t)layout, (uint16_t)level};
+            memcpy(meta.data() + BITMAP_SECTORS * SECTOR_SIZE, &sb, sizeof(sb));
+            if (dev.m_Write(d, metaRow(dev), meta.data(), META_SECTORS) != META_SECTORS)
+                return false;
+        }
+        return true;
     }
 
     int start(const TBlkDev &dev){
+        std::unique_lock op(m_OpMtx);
+        stopResync();
+        m_Dev = dev;
+        m_FailedMask = 0;
+        dropCache();
+        m_Io.stop();
+        if (!validGeometry(dev))
+            return m_Status = RAID_FAILED;
+        m_Io.start(dev);
 
+        // one sector per member, the superblock
+        Batch meta(dev.m_Devices, metaRow(dev), META_SECTORS);
+        std::vector<IoEngine::Transfer> reads;
+        for (int d = 0; d < dev.m_Devices; d++)
+            addTransfer(reads, meta, d, false, BITMAP_SECTORS, META_SECTORS);
+        m_Io.run(reads);
+
+        // the valid superblock of the highest generation describes the volume, a member that is unreadable, foreign
+        // or of an older generation missed updates and is failed
+        std::vector<RaidSuperblock> sb(dev.m_Devices);
+        int current = -1;
+        for (int d = 0; d < dev.m_Devices; d++) {
+            memcpy(&sb[d], meta.sector(d, BITMAP_SECTORS), sizeof(sb[d]));
+            if (!reads[d].ok || sb[d].magic != RaidSuperblock::MAGIC || sb[d].device != d || sb[d].devices != dev.m_Devices
+                || !validLayout(dev, sb[d].chunk, sb[d].layout, sb[d].level))
+                sb[d].magic = 0;
+            else if (current < 0 || sb[d].generation > sb[current].generation)
+                current = d;
+        }
+        std::vector<bool> failed(dev.m_Devices, true);
+        if (current >= 0) {
+            m_Uuid = sb[current].uuid;
+            m_Generation = m_MarkGeneration = m_StoredGeneration = sb[current].generation;
+            m_Chunk = sb[current].chunk;
+            m_Layout = sb[current].layout;
+            m_Parity = sb[current].level - 4;
+            for (int d = 0; d < dev.m_Devices; d++)
+                failed[d] = !sb[d].magic || sb[d].uuid != m_Uuid || sb[d].generation != m_Generation
+                            || sb[d].chunk != m_Chunk || sb[d].layout != m_Layout || sb[d].level != m_Parity + 4;
+        }
+
+        // the bitmap of a clean volume is empty, otherwise the bitmaps of the current members are merged
+        m_Bitmap.assign(BITMAP_SECTORS * SECTOR_SIZE, 0);
+        if (current >= 0 && !sb[current].clean) {
+            std::vector<IoEngine::Transfer> bitmapReads;
+            for (int d = 0; d < dev.m_Devices; d++)
+                if (!failed[d])
+                    addTransfer(bitmapReads, meta, d, false, 0, BITMAP_SECTORS);
+            m_Io.run(bitmapReads);
+            for (const auto &t : bitmapReads) {
+                failed[t.device] = failed[t.device] || !t.ok;
+                for (size_t i = 0; i < m_Bitmap.size() && t.ok; i++)
+                    m_Bitmap[i] |= meta.sector(t.device, 0)[i];
+            }
+        }
+        m_Touched.assign(regions(), 0);
+        m_Pending.assign(regions(), 0);
+        m_Sweep = std::chrono::steady_clock::now();
+
+        int failedCnt = 0;
+        for (int d = 0; d < dev.m_Devices; d++)
+            if (failed[d]) {
+                failedCnt++;
+                m_FailedMask |= 1u << d;
+            }
+
+        if (current < 0 || failedCnt > m_Parity)
+            return m_Status = RAID_FAILED;
+        if (failedCnt)
+            return m_Status = RAID_DEGRADED;
+
+        // marked regions of a volume that was not stopped may have been written partially, make their parity match
+        m_Status = RAID_OK;
+        for (int region = 0; region < regions() && m_Status == RAID_OK; region++)
+            if (regionMarked(region))
+                rebuildRegion(region, 0);
+        if (m_Status == RAID_OK && std::find_if(m_Bitmap.begin(), m_Bitmap.end(), [](uint8_t x){ return x; }) != m_Bitmap.end()) {
+            uint64_t generation;
+            {
+                std::lock_guard lock(m_Mtx);
+                std::fill(m_Bitmap.begin(), m_Bitmap.end(), 0);
+                generation = storeMetadata();
+            }
+            flushMetadata(generation);
+        }
+        return m_Status;
     }
 
     int stop(){
+        std::unique_lock op(m_OpMtx);
+        stopResync();
+        if (m_Status == RAID_STOPPED)
+            return m_Status;
 
+        if (m_Status != RAID_FAILED)
+            flushCache();
+        dropCache();
+        uint64_t generation;
+        {
+            // all writes are complete, a clean volume needs no bits, a degraded one keeps them for resync()
+            std::lock_guard lock(m_Mtx);
+            if (m_Status == RAID_OK)
+                std::fill(m_Bitmap.begin(), m_Bitmap.end(), 0);
+            generation = storeMetadata();
+        }
+        flushMetadata(generation);
+        m_Io.stop();
+        return m_Status = RAID_STOPPED;
     }
 
+    /**
+     * Rebuild the failed members and wait for the rebuild to finish.
+     */
     int resync(){
+        startResync();
+        waitResync();
+        return status();
+    }
+
+    /**
+     * Start rebuilding the failed members (assumed to be replaced or repaired) from the surviving ones in the
+     * background. Members that still hold the metadata of this volume missed only the writes of the regions marked
+     * in the bitmap, a new one is rebuilt whole.
+     */
+    int startResync(){
+        std::shared_lock op(m_OpMtx);
+        std::lock_guard resync(m_ResyncMtx);
+        uint32_t failed = m_FailedMask;
+        if (m_Status != RAID_DEGRADED || m_Resyncing)
+            return m_Status;
+        if (m_ResyncThread.joinable())
+            m_ResyncThread.join();  // a finished rebuild
 
+        bool incremental = true;
+        for (int d = 0; d < m_Dev.m_Devices; d++) {
+            RaidSuperblock sb;
+            if (failed >> d & 1)
+                incremental = incremental && readSuperblock(d, sb) && sb.magic == RaidSuperblock::MAGIC
+                              && (int)sb.device == d && sb.uuid == m_Uuid;
+        }
+        std::lock_guard lock(m_Mtx);
+        if (m_Status != RAID_DEGRADED)
+            return m_Status;
+        m_Cursor = 0;
+        m_Resyncing = true;
+        m_ResyncAbort = false;
+        m_ResyncThread = std::thread(&CRaidVolume::resyncFunction, this, incremental);
+        return m_Status;
+    }
+
+    void waitResync(){
+        std::lock_guard resync(m_ResyncMtx);
+        if (m_ResyncThread.joinable())
+            m_ResyncThread.join();
+    }
+
+    /**
+     * Fraction of the running rebuild that is complete, 1 if no rebuild runs.
+     */
+    double resyncProgress() const{
+        return m_Resyncing ? (double)m_Cursor / dataRows() : 1.0;
+    }
+
+    /**
+     * Limit the rebuild to a share of the device time: a batch that took t is followed by a pause of
+     * t * (1 - share) / share, which leaves the rest to the foreground requests.
+     */
+    void setResyncShare(double share){
+        std::lock_guard lock(m_Mtx);
+        m_ResyncShare = std::max(0.01, std::min(1.0, share));
     }
 
     int status() const{
+        return m_Status;
+    }
 
+    /**
+     * I/O statistics since start() or resetStats(). The counters are updated without locks, a snapshot taken during
+     * requests may be slightly inconsistent. start() replaces the device counters, so both take m_OpMtx shared.
+     */
+    RaidStats stats() const{
+        std::shared_lock op(m_OpMtx);
+        RaidStats stats;
+        m_Io.stats(stats);
+        stats.m_ReadRequests = m_Stats.get(StatCounters::ReadRequests);
+        stats.m_ReadSectors = m_Stats.get(StatCounters::ReadSectors);
+        stats.m_WriteRequests = m_Stats.get(StatCounters::WriteRequests);
+        stats.m_WriteSectors = m_Stats.get(StatCounters::WriteSectors);
+        stats.m_FullStripeRows = m_Stats.get(StatCounters::FullStripeRows);
+        stats.m_ReadModifyWriteRows = m_Stats.get(StatCounters::ReadModifyWriteRows);
+        stats.m_ReconstructWriteRows = m_Stats.get(StatCounters::ReconstructWriteRows);
+        stats.m_RecoverWriteRows = m_Stats.get(StatCounters::RecoverWriteRows);
+        stats.m_NoParityRows = m_Stats.get(StatCounters::NoParityRows);
+        stats.m_RecoveredWindows = m_Stats.get(StatCounters::RecoveredWindows);
+        stats.m_ReconHits = m_Stats.get(StatCounters::ReconHits);
+        stats.m_CacheReadHits = m_Stats.get(StatCounters::CacheReadHits);
+        stats.m_CacheWriteHits = m_Stats.get(StatCounters::CacheWriteHits);
+        stats.m_CacheWriteMisses = m_Stats.get(StatCounters::CacheWriteMisses);
+        stats.m_CacheEvictions = m_Stats.get(StatCounters::CacheEvictions);
+        stats.m_ResyncRows = m_Stats.get(StatCounters::ResyncRows);
+        stats.m_ReadAheadSectors = m_Stats.get(StatCounters::ReadAheadSectors);
+        stats.m_ReadAheadHits = m_Stats.get(StatCounters::ReadAheadHits);
+        stats.m_ResyncProgress = resyncProgress();
+        stats.m_ReadLatency = m_Stats.latency(false);
+        stats.m_WriteLatency = m_Stats.latency(true);
+        return stats;
     }
 
-    int size() const{
+    void resetStats(){
+        std::shared_lock op(m_OpMtx);
+        m_Io.resetStats();
+        m_Stats.reset();
+    }
 
+    int size() const{
+        return (m_Dev.m_Devices - m_Parity) * dataRows();
     }
 
     bool read(int secNr, void *data, int secCnt){
+        std::shared_lock op(m_OpMtx);
+        if (!checkRequest(secNr, secCnt))
+            return false;
+        RequestStats request(m_Stats, false, secCnt);
 
+        auto *dst = (uint8_t *)data;
+        bool sequential;
+        int served = readAhead(secNr, dst, secCnt, sequential);
+        if (served < 0)
+            return false;
+        secNr += served;
+        secCnt -= served;
+        dst += served * SECTOR_SIZE;
+
+        int stripeSectors = this->stripeSectors(), batchStripes = BATCH_ROWS / m_Chunk;
+        while (secCnt > 0) {
+            int off = secNr % stripeSectors;
+            int stripes = std::min(batchStripes, (off + secCnt + stripeSectors - 1) / stripeSectors);
+            int cnt = std::min(secCnt, stripes * stripeSectors - off);
+            auto [firstRow, rows] = rowSpan(secNr, cnt);
+            RowLock lock(*this, firstRow, rows, false);
+            if (!readBatch(firstRow, rows, secNr, cnt, dst, sequential))
+                return false;
+            secNr += cnt;
+            secCnt -= cnt;
+            dst += cnt * SECTOR_SIZE;
+        }
+        return true;
     }
 
     bool write(int secNr, const void *data, int secCnt){
+        std::shared_lock op(m_OpMtx);
+        if (!checkRequest(secNr, secCnt))
+            return false;
+        RequestStats request(m_Stats, true, secCnt);
 
+        auto *src = (const uint8_t *)data;
+        int stripeSectors = this->stripeSectors(), batchStripes = BATCH_ROWS / m_Chunk;
+        while (secCnt > 0) {
+            int off = secNr % stripeSectors, cnt;
+            if (off || secCnt < stripeSectors) {
+                // part of a stripe goes to the cache, or straight to the devices when the cache is disabled
+                cnt = std::min(secCnt, stripeSectors - off);
+                auto [firstRow, rows] = rowSpan(secNr, cnt);
+                RowLock lock(*this, firstRow, rows, true);
+                dropReadAhead(secNr, cnt);
+                if (!(m_CacheRows ? cacheWrite(secNr, cnt, src, lock) : writeBatch(firstRow, rows, secNr, cnt, src)))
+                    return false;
+            } else {
+                // whole stripes are full-stripe writes, they supersede any cached copy
+                int stripes = std::min(batchStripes, secCnt / stripeSectors);
+                int firstRow = secNr / stripeSectors * m_Chunk, rows = stripes * m_Chunk;
+                cnt = stripes * stripeSectors;
+                RowLock lock(*this, firstRow, rows, true);
+                dropReadAhead(secNr, cnt);
+                uncacheRows(firstRow, rows);
+                if (!writeBatch(firstRow, rows, secNr, cnt, src))
+                    return false;
+            }
+            secNr += cnt;
+            secCnt -= cnt;
+            src += cnt * SECTOR_SIZE;
+        }
+        return true;
+    }
+
+    /**
+     * Limit the write-back cache to rows stripe rows, 0 (the default) disables it. Rows over the new limit are flushed
+     * and evicted. Cached writes reach the devices only on eviction or stop().
+     */
+    bool setCacheRows(int rows){
+        std::unique_lock op(m_OpMtx);
+        m_CacheRows = std::max(0, rows);
+        while ((int)m_Cache.size() > m_CacheRows)
+            if (!evictRow(m_Lru.back(), [](int){ return true; }))
+                return false;
+        return true;
     }
 
 protected:
+    static constexpr int BITMAP_SECTORS = 2;
+    static constexpr int META_SECTORS = BITMAP_SECTORS + 1;
+    static constexpr int REGION_ROWS = 1024;        // rows covered by one bit of the write-intent bitmap
+    static constexpr std::chrono::milliseconds SWEEP_PERIOD{1000};  // between two lazy clears of the bitmap
+    static constexpr int BATCH_ROWS = 128;
+    static constexpr int RECON_ROWS = 32;           // rows of the failed devices recovered together
+    static constexpr int RECON_WINDOWS = 32;        // reconstructed windows kept in degraded mode
+    static constexpr int REBUILD_ROWS = 512;        // rows of one rebuild pipeline slot
+    static constexpr int PIPELINE_DEPTH = 4;        // rebuild slots read ahead of the cursor
+    static constexpr int LOCK_ROWS = RECON_ROWS;    // rows of one row group, a reconstruction window is never split
+    static constexpr int LOCK_SLOTS = 32;           // row locks, row groups share them round robin
+    static constexpr int EVICT_TRIES = 8;           // cached rows tried when the least recently used one is locked
+    static constexpr int STREAMS = 4;               // sequential readers tracked for read-ahead
+    static constexpr int STREAM_MIN_ROWS = 8;       // first read-ahead window, it doubles up to BATCH_ROWS
+
+    static_assert((MAX_DEVICE_SECTORS + REGION_ROWS - 1) / REGION_ROWS <= BITMAP_SECTORS * SECTOR_SIZE * 8);
+
+    /**
+     * Image of rows [m_FirstRow, m_FirstRow + m_Rows) of all devices, device by device.
+     */
+    struct Batch {
+        int m_FirstRow;
+        int m_Rows;
+        std::vector<uint8_t> m_Data;
+
+        Batch(int devices, int firstRow, int rows)
+            : m_FirstRow(firstRow), m_Rows(rows), m_Data((size_t)devices * rows * SECTOR_SIZE) {
+        }
+
+        uint8_t *sector(int device, int row){
+            return m_Data.data() + ((size_t)device * m_Rows + row) * SECTOR_SIZE;
+        }
+    };
+
+    /**
+     * Cached data sectors of one row. Valid sectors hold the current content, dirty ones are not on the devices yet.
+     */
+    struct CachedRow {
+        std::vector<uint8_t> m_Data;
+        std::vector<char> m_Valid;
+        std::vector<char> m_Dirty;
+        std::list<int>::iterator m_Lru;
+
+        bool dirty() const{
+            return std::find(m_Dirty.begin(), m_Dirty.end(), 1) != m_Dirty.end();
+        }
+
+        bool complete() const{
+            return std::find(m_Valid.begin(), m_Valid.end(), 0) == m_Valid.end();
+        }
+    };
+
+    /**
+     * Reconstructed content of the failed devices in m_Rows rows from window * RECON_ROWS, the rows of every failed
+     * device follow those of the lower numbered ones.
+     */
+    struct ReconWindow {
+        int m_Rows;
+        std::vector<uint8_t> m_Data;
+        std::list<int>::iterator m_Lru;
+
+        const uint8_t *sector(uint32_t mask, int device, int row) const{
+            int slot = std::popcount(mask & ((1u << device) - 1));
+            return m_Data.data() + ((size_t)slot * m_Rows + row) * SECTOR_SIZE;
+        }
+    };
+
+    /**
+     * A sequential reader: the sector its next request is expected at, the read-ahead window for the next refill and
+     * the prefetched logical sectors from m_First on.
+     */
+    struct ReadStream {
+        uint64_t m_Id;
+        uint64_t m_Used;                            // m_StreamClock of the last request, the oldest stream is replaced
+        int m_Next;
+        int m_Rows;
+        int m_First = 0;
+        std::vector<uint8_t> m_Data;
+
+        bool holds(int sec) const{
+            return sec >= m_First && sec < m_First + (int)(m_Data.size() / SECTOR_SIZE);
+        }
+    };
+
+    /**
+     * Rows [m_FirstRow, m_FirstRow + m_Rows) of the rebuilt member, read and reconstructed ahead of the cursor.
+     */
+    struct RebuildSlot {
+        int m_FirstRow;
+        int m_Rows;
+        Batch m_Batch;
+        std::vector<IoEngine::Transfer> m_Transfers;
+    };
+
+    /**
+     * Counts a request of secCnt sectors in the statistics, and its latency when it returns.
+     */
+    class RequestStats {
+    public:
+        RequestStats(StatCounters &stats, bool write, int secCnt)
+            : m_Stats(stats), m_Write(write), m_Start(std::chrono::steady_clock::now()){
+            stats.add(write ? StatCounters::WriteRequests : StatCounters::ReadRequests);
+            stats.add(write ? StatCounters::WriteSectors : StatCounters::ReadSectors, secCnt);
+        }
+
+        ~RequestStats(){
+            m_Stats.addLatency(m_Write, std::chrono::steady_clock::now() - m_Start);
+        }
+
+    private:
+        StatCounters &m_Stats;
+        bool m_Write;
+        std::chrono::steady_clock::time_point m_Start;
+    };
+
+    /**
+     * Hold of the row locks of rows [firstRow, firstRow + rows), exclusive for a write and shared for a read. The
+     * slots are locked in ascending order, so requests overlapping in any way cannot deadlock.
+     */
+    class RowLock {
+    public:
+        RowLock(CRaidVolume &volume, int firstRow, int rows, bool exclusive) : m_Volume(volume), m_Exclusive(exclusive){
+            int firstGroup = firstRow / LOCK_ROWS, groups = rows > 0 ? (firstRow + rows - 1) / LOCK_ROWS - firstGroup + 1 : 0;
+            for (int group = firstGroup; group < firstGroup + std::min(groups, LOCK_SLOTS); group++)
+                m_Slots.push_back(group % LOCK_SLOTS);
+            std::sort(m_Slots.begin(), m_Slots.end());
+            for (int slot : m_Slots)
+                m_Exclusive ? m_Volume.m_RowLocks[slot].lock() : m_Volume.m_RowLocks[slot].lock_shared();
+        }
+
+        RowLock(const RowLock &) = delete;
+        RowLock &operator=(const RowLock &) = delete;
+
+        ~RowLock(){
+            for (int slot : m_Slots)
+                m_Exclusive ? m_Volume.m_RowLocks[slot].unlock() : m_Volume.m_RowLocks[slot].unlock_shared();
+        }
+
+        bool holds(int row) const{
+            return std::binary_search(m_Slots.begin(), m_Slots.end(), lockSlot(row));
+        }
+
+    private:
+        CRaidVolume &m_Volume;
+        bool m_Exclusive;
+        std::vector<int> m_Slots;
+    };
+
+    /**
+     * The failed members and the resync cursor as seen by one request. The failed members are usable again below
+     * the cursor.
+     */
+    struct Failure {
+        uint32_t m_Mask;
+        int m_Cursor;
+
+        bool at(int device, int row) const{
+            return (m_Mask >> device & 1) && row >= m_Cursor;
+        }
+
+        // the members failed in row
+        uint32_t mask(int row) const{
+            return row >= m_Cursor ? m_Mask : 0;
+        }
+    };
+
+    TBlkDev m_Dev{};
+    int m_Chunk = 1;                                // rows of a stripe
+    int m_Layout = LAYOUT_LEFT_ASYMMETRIC;
+    int m_Parity = 1;                               // parity devices per row, 1 for RAID5, 2 for RAID6
+    std::atomic<int> m_Status = RAID_STOPPED;
+    std::atomic<uint32_t> m_FailedMask = 0;         // failed members, at most m_Parity unless the volume failed
+    int m_CacheRows = 0;
+    uint64_t m_Uuid = 0;
+    uint64_t m_Generation = 0;                      // newest generation of the metadata, guarded by m_Mtx
+    uint64_t m_MarkGeneration = 0;                  // generation that set the last bit of m_Bitmap
+    std::atomic<uint64_t> m_StoredGeneration = 0;   // generation last written to the members, changed under m_MetaMtx
+    std::vector<uint8_t> m_Bitmap;                  // write-intent bitmap as stored on the devices
+    std::vector<char> m_Touched;                    // regions written since the last sweep
+    std::vector<int> m_Pending;                     // writes in flight per region, their bits must stay set
+    std::chrono::steady_clock::time_point m_Sweep;  // time of the last lazy clear
+    IoEngine m_Io;
+    mutable std::mutex m_Mtx;
+    std::mutex m_MetaMtx;                           // serializes flushMetadata(), taken before m_Mtx
+    mutable std::shared_mutex m_OpMtx;              // shared by requests, exclusive for start(), stop() and setCacheRows()
+    std::shared_mutex m_RowLocks[LOCK_SLOTS];
+    std::mutex m_ResyncMtx;                         // guards m_ResyncThread
+    std::thread m_ResyncThread;
+    std::atomic<bool> m_Resyncing = false;
+    bool m_ResyncAbort = false;
+    std::atomic<int> m_Cursor = 0;                  // rows of the failed members rebuilt by the running resync
+    int m_ReadAhead = 0;                            // rows handed to the rebuild pipeline
+    double m_ResyncShare = 1.0;
+    std::unordered_map<int, CachedRow> m_Cache;
+    std::list<int> m_Lru;                           // cached rows, most recently used first
+    std::unordered_map<int, ReconWindow> m_Recon;
+    std::list<int> m_ReconLru;                      // reconstructed windows, most recently used first
+    std::vector<std::pair<int, int>> m_Stale;       // rows written between the resync cursor and m_ReadAhead
+    std::vector<ReadStream> m_Streams;              // at most STREAMS
+    uint64_t m_StreamClock = 0;
+    StatCounters m_Stats;
+
+    static bool validGeometry(const TBlkDev &dev){
+        return dev.m_Devices >= 3 && dev.m_Devices <= MAX_RAID_DEVICES && dev.m_Sectors >= MIN_DEVICE_SECTORS
+               && dev.m_Sectors <= MAX_DEVICE_SECTORS && dev.m_Read && dev.m_Write;
+    }
+
+    // RAID6 needs two data devices in a row, otherwise it is just a slower mirror
+    static bool validLayout(const TBlkDev &dev, int chunk, int layout, int level){
+        return chunk >= 1 && chunk <= MAX_CHUNK_SECTORS && (layout == LAYOUT_LEFT_ASYMMETRIC || layout == LAYOUT_LEFT_SYMMETRIC)
+               && (level == 5 || (level == 6 && dev.m_Devices >= 4));
+    }
+
+    // rows of whole stripes, the rows between them and the metadata are unused
+    static int dataRows(const TBlkDev &dev, int chunk){
+        return (dev.m_Sectors - META_SECTORS) / chunk * chunk;
+    }
+
+    int dataRows() const{
+        return dataRows(m_Dev, m_Chunk);
+    }
+
+    static int metaRow(const TBlkDev &dev){
+        return dev.m_Sectors - META_SECTORS;
+    }
+
+    bool readSuperblock(int device, RaidSuperblock &sb){
+        uint8_t buffer[SECTOR_SIZE];
+        std::vector<IoEngine::Transfer> read{{device, false, m_Dev.m_Sectors - 1, buffer, 1}};
+        m_Io.run(read);
+        if (!read.front().ok)
+            return false;
+        memcpy(&sb, buffer, sizeof(sb));
+        return true;
+    }
+
+    // start a new generation of the metadata, called with m_Mtx held, flushMetadata() writes it once m_Mtx is released
+    uint64_t storeMetadata(){
+        return ++m_Generation;
+    }
+
+    /**
+     * Make sure a generation of at least generation is on the members: the bitmap and the superblock of the newest
+     * generation are written to all members but the failed ones, one call per member. The failed members keep an older
+     * generation, so start() recognizes them as stale. The stores are serialized by m_MetaMtx and each one writes the
+     * newest image, so a caller whose generation was overtaken has nothing to do. Called without m_Mtx, m_MetaMtx is
+     * taken first.
+     */
+    void flushMetadata(uint64_t generation){
+        if (m_StoredGeneration >= generation)
+            return;
+        std::lock_guard meta(m_MetaMtx);
+        while (m_StoredGeneration < generation) {
+            Batch image(m_Dev.m_Devices, metaRow(m_Dev), META_SECTORS);
+            std::vector<IoEngine::Transfer> writes;
+            uint64_t current;
+            {
+                std::lock_guard lock(m_Mtx);
+                current = m_Generation;
+                uint32_t clean = std::all_of(m_Bitmap.begin(), m_Bitmap.end(), [](uint8_t x){ return !x; });
+                for (int d = 0; d < m_Dev.m_Devices; d++) {
+                    if (m_FailedMask >> d & 1)
+                        continue;
+                    RaidSuperblock sb{RaidSuperblock::MAGIC, (uint16_t)d, (uint16_t)m_Dev.m_Devices, m_Uuid, current,
+                                      clean, (uint16_t)m_Chunk, (uint16_t)m_Layout, (uint16_t)(m_Parity + 4)};
+                    memcpy(image.sector(d, 0), m_Bitmap.data(), m_Bitmap.size());
+                    memcpy(image.sector(d, BITMAP_SECTORS), &sb, sizeof(sb));
+                    addTransfer(writes, image, d, true, 0, META_SECTORS);
+                }
+            }
+            m_Io.run(writes);
+            m_StoredGeneration = current;
+
+            // a member failing here starts yet another generation, which has to follow
+            std::lock_guard lock(m_Mtx);
+            if (!recordFailures(writes))
+                generation = std::max(generation, m_Generation);
+        }
+    }
+
+    int regions() const{
+        return (dataRows() + REGION_ROWS - 1) / REGION_ROWS;
+    }
+
+    bool regionMarked(int region) const{
+        return m_Bitmap[region / 8] >> region % 8 & 1;
+    }
+
+    /**
+     * Set the bits of the regions overlapping rows [firstRow, firstRow + rows), newly set bits are persisted before
+     * the rows are written. The write stays pending in the regions until unmarkRegions().
+     */
+    bool markRegions(int firstRow, int rows){
+        uint64_t generation;
+        {
+            std::lock_guard lock(m_Mtx);
+            bool changed = false;
+            for (int region = firstRow / REGION_ROWS; region <= (firstRow + rows - 1) / REGION_ROWS; region++) {
+                m_Touched[region] = 1;
+                m_Pending[region]++;
+                if (!regionMarked(region)) {
+                    m_Bitmap[region / 8] |= 1 << region % 8;
+                    changed = true;
+                }
+            }
+            if (changed)
+                m_MarkGeneration = storeMetadata();
+            // a bit set by another request may not be stored yet
+            generation = m_MarkGeneration;
+            if (m_Resyncing)
+                noteStale(firstRow, rows);
+        }
+        flushMetadata(generation);
+        return m_Status != RAID_FAILED;
+    }
+
+    // the write of rows [firstRow, firstRow + rows) is complete
+    void unmarkRegions(int firstRow, int rows){
+        uint64_t generation = 0;
+        {
+            std::lock_guard lock(m_Mtx);
+            for (int region = firstRow / REGION_ROWS; region <= (firstRow + rows - 1) / REGION_ROWS; region++)
+                m_Pending[region]--;
+            auto now = std::chrono::steady_clock::now();
+            if (now - m_Sweep >= SWEEP_PERIOD) {
+                m_Sweep = now;
+                generation = sweepBitmap();
+            }
+        }
+        flushMetadata(generation);
+    }
+
+    /**
+     * Lazy clear: regions not written since the previous sweep are consistent, bits are kept while a member is failed.
+     * Returns the generation to flush, 0 if nothing changed.
+     */
+    uint64_t sweepBitmap(){
+        if (m_Status != RAID_OK)
+            return 0;
+        bool changed = false;
+        for (int region = 0; region < regions(); region++) {
+            if (regionMarked(region) && !m_Touched[region] && !m_Pending[region]) {
+                m_Bitmap[region / 8] &= ~(1 << region % 8);
+                changed = true;
+            }
+            m_Touched[region] = 0;
+        }
+        return changed ? storeMetadata() : 0;
+    }
+
+    bool rebuildRegion(int region, uint32_t mask){
+        int last = std::min(dataRows(), (region + 1) * REGION_ROWS);
+        for (int row = region * REGION_ROWS; row < last; row += BATCH_ROWS)
+            if (!rebuildRows(row, std::min(BATCH_ROWS, last - row), mask))
+                return false;
+        return true;
+    }
+
+    /**
+     * Recompute the sectors of the devices in mask in rows [firstRow, firstRow + rows) from the other members, an
+     * empty mask recomputes the parity of every row.
+     */
+    bool rebuildRows(int firstRow, int rows, uint32_t mask){
+        int devices = m_Dev.m_Devices;
+        Batch batch(devices, firstRow, rows);
+        std::vector<IoEngine::Transfer> reads, writes;
+        for (int d = 0; d < devices; d++)
+            if (!(mask >> d & 1))
+                addTransfer(reads, batch, d, false, 0, rows);
+        if (!transfer(reads))
+            return false;
+
+        if (mask) {
+            recover(batch, mask, 0, rows);
+            for (int d = 0; d < devices; d++)
+                if (mask >> d & 1)
+                    addTransfer(writes, batch, d, true, 0, rows);
+        } else {
+            std::vector<std::vector<char>> needWrite(devices, std::vector<char>(rows, 0));
+            for (int row = 0; row < rows; row++) {
+                computeParity(batch, row);
+                for (int d = 0; d < devices; d++)
+                    if (parityMask(firstRow + row) >> d & 1)
+                        needWrite[d][row] = 1;
+            }
+            for (int d = 0; d < devices; d++)
+                forEachRun(needWrite[d], [&](int from, int to){
+                    addTransfer(writes, batch, d, true, from, to);
+                });
+        }
+        return transfer(writes);
+    }
+
+    // first two stages of the rebuild pipeline, survivor reads and reconstruction, run without the volume lock
+    std::unique_ptr<RebuildSlot> readSlot(int firstRow, int rows, uint32_t mask){
+        auto slot = std::make_unique<RebuildSlot>(RebuildSlot{firstRow, rows, Batch(m_Dev.m_Devices, firstRow, rows), {}});
+        for (int d = 0; d < m_Dev.m_Devices; d++)
+            if (!(mask >> d & 1))
+                addTransfer(slot->m_Transfers, slot->m_Batch, d, false, 0, rows);
+        m_Io.run(slot->m_Transfers);
+        if (std::all_of(slot->m_Transfers.begin(), slot->m_Transfers.end(), [](const IoEngine::Transfer &t){ return t.ok; }))
+            recover(slot->m_Batch, mask, 0, rows);
+        return slot;
+    }
+
+    /**
+     * Background rebuild of the failed members as a pipeline: up to PIPELINE_DEPTH slots of REBUILD_ROWS rows are read from
+     * the survivors and reconstructed on worker threads ahead of the cursor, while this thread writes the finished
+     * slots to the new members in order and moves the cursor. An incremental rebuild skips the regions with a clear
+     * bit. Rows the foreground writes while a slot may hold their old content are rebuilt again before the cursor
+     * passes them.
+     */
+    void resyncFunction(bool incremental){
+        int rows = dataRows(), next = 0;
+        uint32_t mask;
+        std::deque<std::future<std::unique_ptr<RebuildSlot>>> inflight;
+        auto last = std::chrono::steady_clock::now();
+        while (true) {
+            {
+                std::lock_guard lock(m_Mtx);
+                if (m_ResyncAbort || m_Status != RAID_DEGRADED)
+                    break;
+                mask = m_FailedMask;
+                while ((int)inflight.size() < PIPELINE_DEPTH && next < rows) {
+                    while (next < rows && incremental && !regionMarked(next / REGION_ROWS))
+                        next = std::min(rows, (next / REGION_ROWS + 1) * REGION_ROWS);
+                    int end = next;
+                    while (end < rows && end - next < REBUILD_ROWS && (!incremental || regionMarked(end / REGION_ROWS)))
+                        end = std::min({rows, next + REBUILD_ROWS, (end / REGION_ROWS + 1) * REGION_ROWS});
+                    if (end > next)
+                        inflight.push_back(std::async(std::launch::async, &CRaidVolume::readSlot, this, next, end - next, mask));
+                    m_ReadAhead = next = end;
+                }
+            }
+            if (inflight.empty()) {
+                advanceCursor(rows);
+                break;
+            }
+
+            // last stage: write the oldest slot
+            std::unique_ptr<RebuildSlot> slot = inflight.front().get();
+            inflight.pop_front();
+            bool read = std::all_of(slot->m_Transfers.begin(), slot->m_Transfers.end(), [](const IoEngine::Transfer &t){ return t.ok; });
+            if (read) {
+                std::vector<IoEngine::Transfer> writes;
+                for (int d = 0; d < m_Dev.m_Devices; d++)
+                    if (mask >> d & 1)
+                        addTransfer(writes, slot->m_Batch, d, true, 0, slot->m_Rows);
+                m_Io.run(writes);
+                slot->m_Transfers.insert(slot->m_Transfers.end(), writes.begin(), writes.end());
+            }
+
+            double share;
+            bool done;
+            uint64_t generation;
+            {
+                std::lock_guard lock(m_Mtx);
+                recordFailures(slot->m_Transfers);
+                generation = m_Generation;
+                done = !read || m_ResyncAbort || m_Status != RAID_DEGRADED;
+                share = m_ResyncShare;
+            }
+            flushMetadata(generation);
+            if (done)
+                break;
+            if (!advanceCursor(slot->m_FirstRow + slot->m_Rows))
+                break;
+            if (share < 1)
+                std::this_thread::sleep_for((std::chrono::steady_clock::now() - last) * ((1 - share) / share));
+            last = std::chrono::steady_clock::now();
+        }
+
+        for (auto &pending : inflight)
+            pending.wait();
+        uint64_t generation = 0;
+        std::unique_lock lock(m_Mtx);
+        if (!m_ResyncAbort && m_Status == RAID_DEGRADED && m_Cursor == rows) {
+            m_FailedMask = 0;
+            m_Status = RAID_OK;
+            m_Recon.clear();
+            m_ReconLru.clear();
+            // the writes in flight keep their bits, as in sweepBitmap()
+            for (int region = 0; region < regions(); region++)
+                if (!m_Pending[region])
+                    m_Bitmap[region / 8] &= ~(1 << region % 8);
+            generation = storeMetadata();
+        }
+        m_Cursor = m_ReadAhead = 0;
+        m_Stale.clear();
+        m_Resyncing = false;
+        lock.unlock();
+        flushMetadata(generation);
+    }
+
+    /**
+     * Move the resync cursor to row, the stale rows it passes are rebuilt first. The passed rows are locked, so the
+     * writes that planned them as failed are complete and have noted their stale rows, and later ones see the cursor.
+     */
+    bool advanceCursor(int row){
+        int cursor = m_Cursor;
+        RowLock lock(*this, cursor, row - cursor, true);
+        std::vector<std::pair<int, int>> stale;
+        {
+            std::lock_guard guard(m_Mtx);
+            if (m_ResyncAbort || m_Status != RAID_DEGRADED || m_Cursor != cursor)
+                return false;
+            stale = m_Stale;
+        }
+        for (const auto &[from, to] : stale)
+            for (int r = std::max(from, cursor); r < std::min(to, row); r += BATCH_ROWS)
+                if (!rebuildRows(r, std::min({BATCH_ROWS, to - r, row - r}), m_FailedMask))
+                    return false;
+
+        std::lock_guard guard(m_Mtx);
+        if (m_ResyncAbort || m_Status != RAID_DEGRADED)
+            return false;
+        m_Stats.add(StatCounters::ResyncRows, row - cursor);
+        m_Cursor = row;
+        m_Stale.erase(std::remove_if(m_Stale.begin(), m_Stale.end(), [&](const std::pair<int, int> &range){
+            return range.second <= row;
+        }), m_Stale.end());
+        return true;
+    }
+
+    // a foreground write of rows the rebuild pipeline may have read already, called with m_Mtx held
+    void noteStale(int firstRow, int rows){
+        int from = std::max(firstRow, m_Cursor.load()), to = std::min(firstRow + rows, m_ReadAhead);
+        if (from < to)
+            m_Stale.emplace_back(from, to);
+    }
+
+    void stopResync(){
+        {
+            std::lock_guard lock(m_Mtx);
+            m_ResyncAbort = true;
+        }
+        waitResync();
+    }
+
+    bool checkRequest(int secNr, int secCnt) const{
+        return (m_Status == RAID_OK || m_Status == RAID_DEGRADED) && secNr >= 0 && secCnt >= 0
+               && secNr <= size() && secCnt <= size() - secNr;
+    }
+
+    int stripeSectors() const{
+        return m_Chunk * (m_Dev.m_Devices - m_Parity);
+    }
+
+    // logical sector sec is data sector sectorIdx(sec) of row sectorRow(sec), rowSector() maps back
+    int sectorRow(int sec) const{
+        return sec / stripeSectors() * m_Chunk + sec % m_Chunk;
+    }
+
+    int sectorIdx(int sec) const{
+        return sec % stripeSectors() / m_Chunk;
+    }
+
+    int rowSector(int row, int idx) const{
+        return row / m_Chunk * stripeSectors() + idx * m_Chunk + row % m_Chunk;
+    }
+
+    /**
+     * The rows holding logical sectors [secNr, secNr + cnt) as {firstRow, rows}.
+     */
+    std::pair<int, int> rowSpan(int secNr, int cnt) const{
+        int stripeSectors = this->stripeSectors(), first = secNr / stripeSectors, last = (secNr + cnt - 1) / stripeSectors;
+        if (first != last || cnt >= m_Chunk || sectorRow(secNr) > sectorRow(secNr + cnt - 1))
+            return {first * m_Chunk, (last - first + 1) * m_Chunk};
+        return {sectorRow(secNr), sectorRow(secNr + cnt - 1) - sectorRow(secNr) + 1};
+    }
+
+    int parityDevice(int row) const{
+        return m_Dev.m_Devices - 1 - row / m_Chunk % m_Dev.m_Devices;
+    }
+
+    // the Q parity of a RAID6 row follows the P parity, wrapping around to device 0
+    int qDevice(int row) const{
+        return (parityDevice(row) + 1) % m_Dev.m_Devices;
+    }
+
+    uint32_t parityMask(int row) const{
+        return 1u << parityDevice(row) | (m_Parity == 2 ? 1u << qDevice(row) : 0);
+    }
+
+    int dataDevice(int row, int idx) const{
+        int parity = parityDevice(row);
+        if (m_Layout == LAYOUT_LEFT_SYMMETRIC)
+            return (parity + m_Parity + idx) % m_Dev.m_Devices;
+        // skip the parity devices in ascending order, Q is on device 0 when P is on the last one
+        int lo = parity, hi = parity;
+        if (m_Parity == 2) {
+            lo = std::min(parity, qDevice(row));
+            hi = std::max(parity, qDevice(row));
+        }
+        if (idx >= lo)
+            idx++;
+        if (m_Parity == 2 && idx >= hi)
+            idx++;
+        return idx;
+    }
+
+    // inverse of dataDevice(), device must not hold the parity of row
+    int dataIdx(int row, int device) const{
+        int parity = parityDevice(row);
+        if (m_Layout == LAYOUT_LEFT_SYMMETRIC)
+            return (device - parity - m_Parity + 2 * m_Dev.m_Devices) % m_Dev.m_Devices;
+        return device - std::popcount(parityMask(row) & ((1u << device) - 1));
+    }
+
+    static int lockSlot(int row){
+        return row / LOCK_ROWS % LOCK_SLOTS;
+    }
+
+    Failure failure() const{
+        return {m_FailedMask, m_Cursor};
+    }
+
+    /**
+     * Record a failure of a member, more than m_Parity failed members fail the whole volume. Called with m_Mtx held.
+     */
+    void markFailed(int device){
+        if (m_FailedMask >> device & 1) {
+            // a member being rebuilt failed again, its rebuilt part is lost
+            m_ResyncAbort = true;
+            m_Cursor = 0;
+            return;
+        }
+        // the running rebuild recovers the old set of members only, the cursor does not apply to the new one
+        m_FailedMask |= 1u << device;
+        m_Recon.clear();
+        m_ReconLru.clear();
+        if (m_Resyncing) {
+            m_ResyncAbort = true;
+            m_Cursor = 0;
+        }
+        m_Status = std::popcount(m_FailedMask.load()) > m_Parity ? RAID_FAILED : RAID_DEGRADED;
+    }
+
+    static void addTransfer(std::vector<IoEngine::Transfer> &transfers, Batch &batch, int device, bool write, int from,
+                            int to){
+        transfers.push_back({device, write, batch.m_FirstRow + from, batch.sector(device, from), to - from});
+    }
+
+    /**
+     * Run the transfers concurrently, the devices of the failed ones are marked failed.
+     */
+    bool transfer(std::vector<IoEngine::Transfer> &transfers){
+        m_Io.run(transfers);
+        if (std::all_of(transfers.begin(), transfers.end(), [](const IoEngine::Transfer &t){ return t.ok; }))
+            return true;
+        bool ok;
+        uint64_t generation;
+        {
+            std::lock_guard lock(m_Mtx);
+            ok = recordFailures(transfers);
+            generation = m_Generation;
+        }
+        flushMetadata(generation);
+        return ok;
+    }
+
+    // mark the devices of the failed transfers failed, called with m_Mtx held, the caller flushes the metadata
+    bool recordFailures(const std::vector<IoEngine::Transfer> &transfers){
+        uint32_t mask = m_FailedMask;
+        bool ok = true;
+        for (const auto &t : transfers)
+            if (!t.ok) {
+                markFailed(t.device);
+                ok = false;
+            }
+        // the survivors move to a new generation at once, a failed member must not look current after a crash
+        if (m_FailedMask != mask && m_Status != RAID_FAILED)
+            storeMetadata();
+        return ok;
+    }
+
+    /**
+     * Recover the sectors of the devices in mask (at most m_Parity of them) in batch rows [from, to) from the other
+     * devices, rows are contiguous per device. RAID5 xors the survivors. RAID6 solves the parity equations stripe by
+     * stripe with the syndromes p, q of the surviving data: a lost data sector x is P ^ p, or g^-x (Q ^ q) if P is
+     * lost too, two lost data sectors x, y satisfy D_x ^ D_y = P ^ p and g^x D_x ^ g^y D_y = Q ^ q. A lost parity is
+     * regenerated from the complete data.
+     */
+    void recover(Batch &batch, uint32_t mask, int from, int to){
+        int devices = m_Dev.m_Devices, dataPerRow = devices - m_Parity;
+        const uint8_t *src[MAX_RAID_DEVICES];
+        if (m_Parity == 1) {
+            int device = std::countr_zero(mask), srcCnt = 0;
+            for (int d = 0; d < devices; d++)
+                if (d != device)
+                    src[srcCnt++] = batch.sector(d, from);
+            xorBlocks(batch.sector(device, from), src, srcCnt, (size_t)(to - from) * SECTOR_SIZE);
+            return;
+        }
+
+        for (int a = from, b; a < to; a = b) {
+            int row = batch.m_FirstRow + a, lost[2], lostCnt = 0;
+            b = std::min(to, a + m_Chunk - row % m_Chunk);
+            size_t len = (size_t)(b - a) * SECTOR_SIZE;
+            for (int idx = 0; idx < dataPerRow; idx++) {
+                int d = dataDevice(row, idx);
+                src[idx] = mask >> d & 1 ? nullptr : batch.sector(d, a);
+                if (!src[idx])
+                    lost[lostCnt++] = idx;
+            }
+            uint8_t *pDev = batch.sector(parityDevice(row), a), *qDev = batch.sector(qDevice(row), a);
+            bool pLost = mask >> parityDevice(row) & 1, qLost = mask >> qDevice(row) & 1;
+            if (!lostCnt) {
+                std::vector<uint8_t> scratch(pLost && qLost ? 0 : len);
+                genSyndrome(pLost ? pDev : scratch.data(), qLost ? qDev : scratch.data(), src, dataPerRow, len);
+                continue;
+            }
+
+            std::vector<uint8_t> scratch(2 * len);
+            uint8_t *p = scratch.data(), *q = p + len, *x = batch.sector(dataDevice(row, lost[0]), a);
+            genSyndrome(p, q, src, dataPerRow, len);
+            const uint8_t *pSrc[] = {p, pDev}, *qSrc[] = {q, qDev};
+            if (lostCnt == 1 && !pLost)
+                xorBlocks(x, pSrc, 2, len);
+            else if (lostCnt == 1) {
+                xorBlocks(q, qSrc, 2, len);
+                gfMulBlocks(x, q, gf.inv(gf.pow(lost[0])), len);
+            } else {
+                uint8_t *y = batch.sector(dataDevice(row, lost[1]), a);
+                xorBlocks(p, pSrc, 2, len);
+                xorBlocks(q, qSrc, 2, len);
+                gfMulXorBlocks(q, p, gf.pow(lost[1]), len);
+                gfMulBlocks(x, q, gf.inv(gf.pow(lost[0]) ^ gf.pow(lost[1])), len);
+                const uint8_t *ySrc[] = {p, x};
+                xorBlocks(y, ySrc, 2, len);
+            }
+            if (pLost || qLost) {
+                for (int i = 0; i < lostCnt; i++)
+                    src[lost[i]] = batch.sector(dataDevice(row, lost[i]), a);
+                genSyndrome(pLost ? pDev : p, qLost ? qDev : q, src, dataPerRow, len);
+            }
+        }
+    }
+
+    void computeParity(Batch &batch, int row){
+        recover(batch, parityMask(batch.m_FirstRow + row), row, row + 1);
+    }
+
+    /**
+     * Sequential read-ahead: serve the start of a request from the prefetched sectors of a stream and return how many
+     * sectors were served, -1 if the volume failed. A request starting where a stream stopped, or inside its
+     * prefetched sectors, continues the stream; if the rest of the request is small, the stream is refilled from
+     * there to the end of the read-ahead window, rounded to whole stripes and read by readBatch() with one call per
+     * device. The window starts at STREAM_MIN_ROWS rows and doubles with every refill, or request too large for it,
+     * up to a batch, so a stream pays for a large read-ahead only once it proved sequential. Any other request starts a new stream in place of the
+     * least recently used one. The prefetched sectors are stored while their rows are locked, and a write drops the
+     * ones it overlaps under its exclusive lock, so they never get stale. sequential tells whether the request
+     * continued a stream.
+     */
+    int readAhead(int secNr, uint8_t *dst, int secCnt, bool &sequential){
+        int stripeSectors = this->stripeSectors(), served = 0, window, from;
+        uint64_t id;
+        {
+            std::lock_guard lock(m_Mtx);
+            auto it = std::find_if(m_Streams.begin(), m_Streams.end(), [&](const ReadStream &stream){
+                return stream.m_Next == secNr || stream.holds(secNr);
+            });
+            sequential = it != m_Streams.end();
+            if (!sequential) {
+                if ((int)m_Streams.size() < STREAMS)
+                    it = m_Streams.emplace(m_Streams.end());
+                else
+                    it = std::min_element(m_Streams.begin(), m_Streams.end(), [](const ReadStream &a, const ReadStream &b){
+                        return a.m_Used < b.m_Used;
+                    });
+                *it = ReadStream{++m_StreamClock, m_StreamClock, secNr + secCnt, std::max(STREAM_MIN_ROWS, m_Chunk), 0, {}};
+                return 0;
+            }
+
+            if (it->holds(secNr)) {
+                served = std::min(secCnt, it->m_First + (int)(it->m_Data.size() / SECTOR_SIZE) - secNr);
+                memcpy(dst, it->m_Data.data() + (size_t)(secNr - it->m_First) * SECTOR_SIZE, (size_t)served * SECTOR_SIZE);
+                m_Stats.add(StatCounters::ReadAheadHits, served);
+            }
+            it->m_Next = secNr + secCnt;
+            it->m_Used = ++m_StreamClock;
+            // requests of a quarter of the largest window move large device calls on their own
+            int maxRows = BATCH_ROWS / m_Chunk * m_Chunk;
+            window = it->m_Rows / m_Chunk * stripeSectors;
+            if (served == secCnt || secCnt * 4 > maxRows / m_Chunk * stripeSectors)
+                return served;
+            it->m_Rows = std::min(maxRows, it->m_Rows * 2);
+            if (secCnt - served > window)
+                return served;
+            id = it->m_Id;
+            from = secNr + served;
+        }
+
+        int to = std::min(size(), (from / stripeSectors) * stripeSectors + window);
+        if (to < secNr + secCnt)
+            return served;
+        std::vector<uint8_t> data((size_t)(to - from) * SECTOR_SIZE);
+        auto [firstRow, rows] = rowSpan(from, to - from);
+        RowLock lock(*this, firstRow, rows, false);
+        if (!readBatch(firstRow, rows, from, to - from, data.data(), true))
+            return -1;
+        memcpy(dst + (size_t)served * SECTOR_SIZE, data.data(), (size_t)(secNr + secCnt - from) * SECTOR_SIZE);
+
+        std::lock_guard guard(m_Mtx);
+        m_Stats.add(StatCounters::ReadAheadSectors, to - secNr - secCnt);
+        for (auto &stream : m_Streams)
+            if (stream.m_Id == id) {
+                stream.m_First = from;
+                stream.m_Data = std::move(data);
+            }
+        return secCnt;
+    }
+
+    // a write of sectors [secNr, secNr + cnt) makes the prefetched ones stale, called with their rows locked
+    void dropReadAhead(int secNr, int cnt){
+        std::lock_guard lock(m_Mtx);
+        for (auto &stream : m_Streams)
+            if (!stream.m_Data.empty() && secNr < stream.m_First + (int)(stream.m_Data.size() / SECTOR_SIZE)
+                && secNr + cnt > stream.m_First)
+                stream.m_Data.clear();
+    }
+
+    /**
+     * Read cnt logical sectors starting at secNr, all of them stored in the rows of the batch. Sectors in the cache
+     * are newer than the devices, the devices are read only if the cache does not hold all of them. The rows are
+     * locked shared, so their cached entries stay in place without m_Mtx. sequential is passed to readDevices().
+     */
+    bool readBatch(int firstRow, int rows, int secNr, int cnt, uint8_t *dst, bool sequential){
+        int dataPerRow = m_Dev.m_Devices - m_Parity, hits = 0;
+        std::vector<const uint8_t *> cached;
+        {
+            std::lock_guard lock(m_Mtx);
+            cached.resize(m_Cache.empty() ? 0 : cnt, nullptr);
+            for (int row = firstRow; row < firstRow + rows && !m_Cache.empty(); row++) {
+                auto it = m_Cache.find(row);
+                if (it == m_Cache.end())
+                    continue;
+                touchRow(it->second);
+                for (int idx = 0; idx < dataPerRow; idx++) {
+                    int sec = rowSector(row, idx);
+                    if (sec >= secNr && sec < secNr + cnt && it->second.m_Valid[idx]) {
+                        cached[sec - secNr] = it->second.m_Data.data() + (size_t)idx * SECTOR_SIZE;
+                        hits++;
+                    }
+                }
+            }
+        }
+
+        m_Stats.add(StatCounters::CacheReadHits, hits);
+        if (hits < cnt && !readDevices(firstRow, rows, secNr, cnt, dst, sequential))
+            return false;
+        for (int i = 0; i < (int)cached.size(); i++)
+            if (cached[i])
+                memcpy(dst + (size_t)i * SECTOR_SIZE, cached[i], SECTOR_SIZE);
+        return true;
+    }
+
+    /**
+     * Read cnt logical sectors starting at secNr from the devices. Every device is read once over the rows it is
+     * needed for. In degraded mode the sectors of the failed devices come from the reconstruction cache. A missing one
+     * of a sequential read has its whole window of RECON_ROWS rows recovered by a single pass and cached, so sequential
+     * degraded reads do not fan out to all devices for every sector; any other read recovers just the rows it needs,
+     * a window would only multiply its device reads. All failed devices of a row are recovered together.
+     */
+    bool readDevices(int firstRow, int rows, int secNr, int cnt, uint8_t *dst, bool sequential){
+        int devices = m_Dev.m_Devices;
+        while (true) {
+            // the batch spans the requested rows and the windows to reconstruct, the windows share the row locks of
+            // the requested rows
+            Failure failure = this->failure();
+            std::vector<char> cached(cnt, 0), lost(rows, 0);
+            std::vector<int> windows;
+            int lo = firstRow, hi = firstRow + rows;
+            {
+                std::lock_guard lock(m_Mtx);
+                for (int sec = secNr; sec < secNr + cnt; sec++) {
+                    int row = sectorRow(sec), window = row / RECON_ROWS;
+                    int device = dataDevice(row, sectorIdx(sec));
+                    if (!failure.at(device, row))
+                        continue;
+                    auto it = m_Recon.find(window);
+                    if (it != m_Recon.end()) {
+                        m_ReconLru.splice(m_ReconLru.begin(), m_ReconLru, it->second.m_Lru);
+                        memcpy(dst + (size_t)(sec - secNr) * SECTOR_SIZE,
+                               it->second.sector(failure.m_Mask, device, row - window * RECON_ROWS), SECTOR_SIZE);
+                        cached[sec - secNr] = 1;
+                    } else if (!sequential) {
+                        lost[row - firstRow] = 1;
+                    } else if (windows.empty() || windows.back() != window) {
+                        windows.push_back(window);
+                        lo = std::min(lo, window * RECON_ROWS);
+                        hi = std::max(hi, std::min(dataRows(), (window + 1) * RECON_ROWS));
+                    }
+                }
+            }
+
+            Batch batch(devices, lo, hi - lo);
+            std::vector<int> from(devices, hi - lo), to(devices, 0);
+            auto need = [&](int device, int rowFrom, int rowTo){
+                from[device] = std::min(from[device], rowFrom - lo);
+                to[device] = std::max(to[device], rowTo - lo);
+            };
+            for (int sec = secNr; sec < secNr + cnt; sec++) {
+                int row = sectorRow(sec), device = dataDevice(row, sectorIdx(sec));
+                if (!failure.at(device, row))
+                    need(device, row, row + 1);
+            }
+            for (int window : windows)
+                for (int d = 0; d < devices; d++)
+                    if (!(failure.m_Mask >> d & 1))
+                        need(d, window * RECON_ROWS, std::min(hi, (window + 1) * RECON_ROWS));
+            forEachRun(lost, [&](int rowFrom, int rowTo){
+                for (int d = 0; d < devices; d++)
+                    if (!(failure.m_Mask >> d & 1))
+                        need(d, firstRow + rowFrom, firstRow + rowTo);
+            });
+
+            std::vector<IoEngine::Transfer> reads;
+            for (int d = 0; d < devices; d++)
+                if (from[d] < to[d])
+                    addTransfer(reads, batch, d, false, from[d], to[d]);
+            bool ok = transfer(reads);
+            if (m_Status == RAID_FAILED)
+                return false;
+            if (!ok)
+                continue;           // degraded now, retry with reconstruction
+
+            for (int window : windows)
+                recover(batch, failure.m_Mask, window * RECON_ROWS - lo, std::min(hi, (window + 1) * RECON_ROWS) - lo);
+            forEachRun(lost, [&](int rowFrom, int rowTo){
+                recover(batch, failure.m_Mask, firstRow + rowFrom - lo, firstRow + rowTo - lo);
+            });
+            m_Stats.add(StatCounters::RecoveredWindows, windows.size());
+            m_Stats.add(StatCounters::ReconHits, std::count(cached.begin(), cached.end(), 1));
+            for (int sec = secNr; sec < secNr + cnt; sec++)
+                if (!cached[sec - secNr]) {
+                    int row = sectorRow(sec);
+                    memcpy(dst + (size_t)(sec - secNr) * SECTOR_SIZE, batch.sector(dataDevice(row, sectorIdx(sec)), row - lo), SECTOR_SIZE);
+                }
+
+            std::lock_guard lock(m_Mtx);
+            for (int window : windows) {
+                int wFrom = window * RECON_ROWS, wTo = std::min(hi, wFrom + RECON_ROWS);
+                if (m_FailedMask == failure.m_Mask && !m_Recon.count(window))
+                    storeRecon(window, batch, failure.m_Mask, wFrom - lo, wTo - wFrom);
+            }
+            return true;
+        }
+    }
+
+    /**
+     * Call fn(from, to) for every maximal run of rows with mask set.
+     */
+    template<typename F>
+    static void forEachRun(const std::vector<char> &mask, F fn){
+        for (int from = 0, rows = (int)mask.size(); from < rows; from++) {
+            if (!mask[from])
+                continue;
+            int to = from;
+            while (to < rows && mask[to])
+                to++;
+            fn(from, to);
+            from = to;
+        }
+    }
+
+    // in the order of the row counters of StatCounters
+    enum class WriteMode {
+        FullStripe,             // all data sectors written, parity from the new data only
+        ReadModifyWrite,        // read old data of written sectors and old parity
+        ReconstructWrite,       // read the data sectors that are not written
+        RecoverWrite,           // RAID6 with a written and an unwritten data sector lost, recover the row first
+        NoParity                // parity devices failed, just write data
+    };
+
+    /**
+     * Pick the cheapest way to update the parity of a row where written of the dataPerRow data sectors change.
+     * In degraded mode the mode must not read the failed devices: read-modify-write needs the old content of the
+     * written sectors, reconstruct-write that of the others.
+     */
+    WriteMode writeMode(int row, const std::vector<char> &written, int writtenCnt, const Failure &failure) const{
+        int dataPerRow = m_Dev.m_Devices - m_Parity;
+        uint32_t lost = failure.mask(row), parity = parityMask(row);
+        if (!(parity & ~lost))
+            return WriteMode::NoParity;
+        if (writtenCnt == dataPerRow)
+            return WriteMode::FullStripe;
+
+        bool rmw = true, rcw = true;
+        for (int d = 0; d < m_Dev.m_Devices; d++)
+            if ((lost & ~parity) >> d & 1)
+                (written[dataIdx(row, d)] ? rmw : rcw) = false;
+        if (rmw && rcw)
+            return writtenCnt + std::popcount(parity & ~lost) < dataPerRow - writtenCnt ? WriteMode::ReadModifyWrite
+                                                                                          : WriteMode::ReconstructWrite;
+        if (rmw || rcw)
+            return rmw ? WriteMode::ReadModifyWrite : WriteMode::ReconstructWrite;
+        return WriteMode::RecoverWrite;
+    }
+
+    /**
+     * Write cnt logical sectors starting at secNr, all of them stored in the rows of the batch.
+     */
+    bool writeBatch(int firstRow, int rows, int secNr, int cnt, const uint8_t *src){
+        int dataPerRow = m_Dev.m_Devices - m_Parity;
+        std::vector<std::vector<char>> written(rows, std::vector<char>(dataPerRow, 0));
+        for (int sec = secNr; sec < secNr + cnt; sec++)
+            written[sectorRow(sec) - firstRow][sectorIdx(sec)] = 1;
+        return writeRows(firstRow, rows, written, [&](int row, int idx){
+            return src + (size_t)(rowSector(firstRow + row, idx) - secNr) * SECTOR_SIZE;
+        });
+    }
+
+    /**
+     * Write the data sectors marked in written[row] of rows [firstRow, firstRow + rows), rows without any are left
+     * alone. source(row, idx) provides their content. Each row picks its parity update (full stripe, read-modify-write,
+     * reconstruct-write or recovery of the lost sectors) to minimize device reads, the reads and writes are then issued as one call per contiguous
+     * run of rows on every device. The caller holds the rows exclusively.
+     */
+    template<typename F>
+    bool writeRows(int firstRow, int rows, const std::vector<std::vector<char>> &written, F source){
+        int devices = m_Dev.m_Devices, dataPerRow = devices - m_Parity;
+        uncacheRecon(firstRow, rows);
+        std::vector<int> writtenCnt(rows, 0);
+        for (int row = 0; row < rows; row++)
+            writtenCnt[row] = (int)std::count(written[row].begin(), written[row].end(), 1);
+
+        Batch batch(devices, firstRow, rows);
+        std::vector<WriteMode> modes(rows);
+        Failure failure{};
+        while (true) {
+            failure = this->failure();
+            std::vector<std::vector<char>> needRead(devices, std::vector<char>(rows, 0));
+            for (int row = 0; row < rows; row++) {
+                if (!writtenCnt[row])
+                    continue;
+                int absRow = firstRow + row;
+                modes[row] = writeMode(absRow, written[row], writtenCnt[row], failure);
+                if (modes[row] == WriteMode::FullStripe || modes[row] == WriteMode::NoParity)
+                    continue;
+                if (modes[row] == WriteMode::RecoverWrite) {
+                    for (int d = 0; d < devices; d++)
+                        if (!failure.at(d, absRow))
+                            needRead[d][row] = 1;
+                    continue;
+                }
+                bool rmw = modes[row] == WriteMode::ReadModifyWrite;
+                for (int idx = 0; idx < dataPerRow; idx++)
+                    if ((bool)written[row][idx] == rmw)
+                        needRead[dataDevice(absRow, idx)][row] = 1;
+                for (int d = 0; d < devices && rmw; d++)
+                    if ((parityMask(absRow) & ~failure.mask(absRow)) >> d & 1)
+                        needRead[d][row] = 1;
+            }
+
+            std::vector<IoEngine::Transfer> reads;
+            for (int d = 0; d < devices; d++)
+                forEachRun(needRead[d], [&](int from, int to){
+                    addTransfer(reads, batch, d, false, from, to);
+                });
+            bool ok = transfer(reads);
+            if (m_Status == RAID_FAILED)
+                return false;
+            if (ok)
+                break;              // otherwise degraded now, plan again without the failed members
+        }
+
+        std::vector<std::vector<char>> needWrite(devices, std::vector<char>(rows, 0));
+        for (int row = 0; row < rows; row++) {
+            if (!writtenCnt[row])
+                continue;
+            m_Stats.add(StatCounters::Counter(StatCounters::FullStripeRows + (int)modes[row]));
+            int absRow = firstRow + row;
+            uint32_t alive = parityMask(absRow) & ~failure.mask(absRow);
+            uint8_t *parity = batch.sector(parityDevice(absRow), row);
+            if (modes[row] == WriteMode::RecoverWrite)
+                recover(batch, failure.mask(absRow), row, row + 1);
+            for (int idx = 0; idx < dataPerRow; idx++) {
+                if (!written[row][idx])
+                    continue;
+                uint8_t *dst = batch.sector(dataDevice(absRow, idx), row);
+                const uint8_t *src = source(row, idx);
+                if (modes[row] == WriteMode::ReadModifyWrite && (alive >> parityDevice(absRow) & 1)) {
+                    const uint8_t *delta[] = {parity, dst, src};
+                    xorBlocks(parity, delta, 3, SECTOR_SIZE);
+                }
+                if (modes[row] == WriteMode::ReadModifyWrite && m_Parity == 2 && (alive >> qDevice(absRow) & 1)) {
+                    // Q changes by g^idx times the change of the sector
+                    uint8_t delta[SECTOR_SIZE];
+                    const uint8_t *diff[] = {dst, src};
+                    xorBlocks(delta, diff, 2, SECTOR_SIZE);
+                    gfMulXorBlocks(batch.sector(qDevice(absRow), row), delta, gf.pow(idx), SECTOR_SIZE);
+                }
+                memcpy(dst, src, SECTOR_SIZE);
+                if (!failure.at(dataDevice(absRow, idx), absRow))
+                    needWrite[dataDevice(absRow, idx)][row] = 1;
+            }
+
+            if (modes[row] == WriteMode::NoParity)
+                continue;
+            if (modes[row] != WriteMode::ReadModifyWrite)
+                computeParity(batch, row);
+            for (int d = 0; d < devices; d++)
+                if (alive >> d & 1)
+                    needWrite[d][row] = 1;
+        }
+
+        // the image is complete, a member failing now just stops receiving its part
+        if (markRegions(firstRow, rows)) {
+            std::vector<IoEngine::Transfer> writes;
+            for (int d = 0; d < devices; d++)
+                forEachRun(needWrite[d], [&](int from, int to){
+                    addTransfer(writes, batch, d, true, from, to);
+                });
+            transfer(writes);
+        }
+        unmarkRegions(firstRow, rows);
+        return m_Status != RAID_FAILED;
+    }
+
+    // the cache functions below are called with m_Mtx held unless they lock it themselves
+    void touchRow(CachedRow &entry){
+        m_Lru.splice(m_Lru.begin(), m_Lru, entry.m_Lru);
+    }
+
+    bool dirtyCached(int row) const{
+        auto it = m_Cache.find(row);
+        return it != m_Cache.end() && it->second.dirty();
+    }
+
+    /**
+     * Store logical sectors [secNr, secNr + cnt) in the cached rows holding them, making room first if the cache is
+     * full. held is the row lock of the caller.
+     */
+    bool cacheWrite(int secNr, int cnt, const uint8_t *src, const RowLock &held){
+        for (int sec = secNr; sec < secNr + cnt; sec++, src += SECTOR_SIZE) {
+            int row = sectorRow(sec), idx = sectorIdx(sec);
+            if (!makeRoom(row, held))
+                return false;
+            std::lock_guard lock(m_Mtx);
+            auto it = m_Cache.find(row);
+            if (it == m_Cache.end()) {
+                int dataPerRow = m_Dev.m_Devices - m_Parity;
+                CachedRow entry{std::vector<uint8_t>((size_t)dataPerRow * SECTOR_SIZE), std::vector<char>(dataPerRow, 0),
+                                std::vector<char>(dataPerRow, 0), m_Lru.insert(m_Lru.begin(), row)};
+                it = m_Cache.emplace(row, std::move(entry)).first;
+                m_Stats.add(StatCounters::CacheWriteMisses);
+            } else {
+                touchRow(it->second);
+                m_Stats.add(StatCounters::CacheWriteHits);
+            }
+
+            CachedRow &entry = it->second;
+            memcpy(entry.m_Data.data() + (size_t)idx * SECTOR_SIZE, src, SECTOR_SIZE);
+            entry.m_Valid[idx] = entry.m_Dirty[idx] = 1;
+        }
+        return true;
+    }
+
+    /**
+     * Evict rows until row fits in the cache. A victim is written like any other row, so it must be locked: rows
+     * the caller holds may go at once, other ones only if their lock is free, waiting for it with locks held could
+     * deadlock. If none of the EVICT_TRIES least recently used rows is free, the cache exceeds its limit for a while.
+     */
+    bool makeRoom(int row, const RowLock &held){
+        while (true) {
+            std::vector<int> victims;
+            {
+                std::lock_guard lock(m_Mtx);
+                if (m_Cache.count(row) || (int)m_Cache.size() < m_CacheRows)
+                    return true;
+                for (auto it = m_Lru.rbegin(); it != m_Lru.rend() && (int)victims.size() < EVICT_TRIES; ++it)
+                    victims.push_back(*it);
+            }
+
+            bool evicted = false;
+            for (size_t i = 0; i < victims.size() && !evicted; i++) {
+                int slot = lockSlot(victims[i]);
+                std::unique_lock<std::shared_mutex> lock(m_RowLocks[slot], std::defer_lock);
+                if (!held.holds(victims[i]) && !lock.try_lock())
+                    continue;
+                if (!evictRow(victims[i], [&](int r){ return held.holds(r) || (lock.owns_lock() && lockSlot(r) == slot); }))
+                    return false;
+                evicted = true;
+                m_Stats.add(StatCounters::CacheEvictions);
+            }
+            if (!evicted)
+                return true;
+        }
+    }
+
+    /**
+     * Write the dirty sectors of cached rows [firstRow, firstRow + rows) to the devices, every row must be cached
+     * and dirty. Complete rows are written whole, so their parity needs no reads. The rows are locked exclusively,
+     * so their entries stay in place without m_Mtx.
+     */
+    bool flushRows(int firstRow, int rows){
+        std::vector<CachedRow *> entries(rows);
+        std::vector<std::vector<char>> written(rows);
+        {
+            std::lock_guard lock(m_Mtx);
+            for (int row = 0; row < rows; row++) {
+                entries[row] = &m_Cache.at(firstRow + row);
+                written[row] = entries[row]->complete() ? entries[row]->m_Valid : entries[row]->m_Dirty;
+            }
+        }
+
+        if (!writeRows(firstRow, rows, written, [&](int row, int idx){
+            return entries[row]->m_Data.data() + (size_t)idx * SECTOR_SIZE;
+        }))
+            return false;
+        std::lock_guard lock(m_Mtx);
+        for (auto *entry : entries)
+            std::fill(entry->m_Dirty.begin(), entry->m_Dirty.end(), 0);
+        return true;
+    }
+
+    // stop() excludes all requests, no row needs a lock
+    bool flushCache(){
+        std::vector<int> dirty;
+        {
+            std::lock_guard lock(m_Mtx);
+            for (const auto &[row, entry] : m_Cache)
+                if (entry.dirty())
+                    dirty.push_back(row);
+        }
+        std::sort(dirty.begin(), dirty.end());
+
+        for (size_t from = 0, to; from < dirty.size(); from = to) {
+            for (to = from + 1; to < dirty.size() && dirty[to] == dirty[to - 1] + 1 && (int)(to - from) < BATCH_ROWS; to++);
+            if (!flushRows(dirty[from], (int)(to - from)))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Evict row, the caller holds its lock. A dirty row takes its dirty neighbours along, so a sequence of small
+     * writes leaves the cache as one batch, locked(r) tells which neighbours the caller holds too.
+     */
+    template<typename F>
+    bool evictRow(int row, F locked){
+        int from = row, to = row + 1;
+        {
+            std::lock_guard lock(m_Mtx);
+            auto it = m_Cache.find(row);
+            if (it == m_Cache.end())
+                return true;        // evicted by another request before the lock was taken
+            if (it->second.dirty()) {
+                while (to - from < BATCH_ROWS && from > 0 && locked(from - 1) && dirtyCached(from - 1))
+                    from--;
+                while (to - from < BATCH_ROWS && locked(to) && dirtyCached(to))
+                    to++;
+            } else
+                to = from;
+        }
+        if (from < to && !flushRows(from, to - from))
+            return false;
+
+        std::lock_guard lock(m_Mtx);
+        auto it = m_Cache.find(row);
+        m_Lru.erase(it->second.m_Lru);
+        m_Cache.erase(it);
+        return true;
+    }
+
+    // rows [firstRow, firstRow + rows) are being overwritten whole, their cached content is obsolete
+    void uncacheRows(int firstRow, int rows){
+        std::lock_guard lock(m_Mtx);
+        for (int row = firstRow; row < firstRow + rows && !m_Cache.empty(); row++) {
+            auto it = m_Cache.find(row);
+            if (it == m_Cache.end())
+                continue;
+            m_Lru.erase(it->second.m_Lru);
+            m_Cache.erase(it);
+        }
+    }
+
+    void dropCache(){
+        std::lock_guard lock(m_Mtx);
+        m_Cache.clear();
+        m_Lru.clear();
+        m_Recon.clear();
+        m_ReconLru.clear();
+        m_Streams.clear();
+    }
+
+    // cache the recovered sectors of the devices in mask in batch rows [from, from + rows) as window
+    void storeRecon(int window, Batch &batch, uint32_t mask, int from, int rows){
+        while ((int)m_Recon.size() >= RECON_WINDOWS) {
+            m_Recon.erase(m_ReconLru.back());
+            m_ReconLru.pop_back();
+        }
+        std::vector<uint8_t> data;
+        for (int d = 0; d < m_Dev.m_Devices; d++)
+            if (mask >> d & 1)
+                data.insert(data.end(), batch.sector(d, from), batch.sector(d, from) + (size_t)rows * SECTOR_SIZE);
+        m_Recon.emplace(window, ReconWindow{rows, std::move(data), m_ReconLru.insert(m_ReconLru.begin(), window)});
+    }
+
+    // the failed devices change their (virtual) content in rows [firstRow, firstRow + rows)
+    void uncacheRecon(int firstRow, int rows){
+        std::lock_guard lock(m_Mtx);
+        for (int window = firstRow / RECON_ROWS; window <= (firstRow + rows - 1) / RECON_ROWS && !m_Recon.empty(); window++) {
+            auto it = m_Recon.find(window);
+            if (it == m_Recon.end())
+                continue;
+            m_ReconLru.erase(it->second.m_Lru);
+            m_Recon.erase(it);
+        }
+    }
 };
 
 #ifndef __PROGTEST__